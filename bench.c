@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "klock.h"
+
+/*
+ * Measures cycle checks against a chain of waiting actors:
+ *		smartlock-bench [iterations [nodes]]
+ * For each number of threads, actor i holds lock i and waits for lock i + 1.
+ * Requests by the last actor for lock 0 or lock 1 close the chain into a
+ * cycle and are rejected; they take turns, since a rejected request repeated
+ * on an unchanged graph is rejected again without a check. With the last
+ * actor left out of the chain, its request for lock 0 follows all of the
+ * chain and is not.
+ * Each line gives the time per cycle check and per whole request in ns, per
+ * repeated request for lock 0, and per check of the cycle case that also
+ * reports the cycle's path.
+ * The fan case measures the same for an intent lock held shared by the heads
+ * of BENCH_FAN chains, so the wait for it branches; only the last chain
+ * leads back to the requester.
+ * smartlock-bench-dfs is built with WAIT_SLOTS=0, so its checks search the
+ * RAG rather than test the wait matrix.
+ * The graph cases time find_cycles() on synthetic wait-for graphs of
+ * 'nodes' threads, 1M by default, with 1 to 8 workers, best of BENCH_RUNS:
+ *		rings:  one in 100 threads in rings of 2 to 8, the others waiting in
+ *		        trees for a ring or for a thread that waits for nothing
+ *		shared: each thread waits for 0 to 4 others at random, as if blocked
+ *		        on intent locks with several holders
+ *		circle: all threads waiting in one cycle
+ * The acquire cases time how long BENCH_CONTENDERS threads take to acquire
+ * one lock they each take iterations / 100 times, holding it for a short
+ * critical section, in us on average and at worst:
+ *		park:    lock_retry() with RETRY_POLICY_DEFAULT, waiting for the holder
+ *		backoff: lock_retry() counting a busy lock as a failed attempt
+ *		spin:    trylock() in a loop until the lock is given
+ */
+
+#define BENCH_MAX 128
+#define BENCH_FAN 4
+#define BENCH_RUNS 3
+#define BENCH_CONTENDERS 4
+#define BENCH_SECTION 200
+
+enum {
+	false,
+	true
+};
+
+const int sizes[] = { 8, 16, 32, 64, 128 };
+const int workers[] = { 1, 2, 4, 8 };
+const char* graphNames[] = { "rings", "shared", "circle" };
+const char* acquireNames[] = { "park", "backoff", "spin" };
+
+/*
+ *	defines one thread of an acquire case; it has:
+ *		kind:    the index of the case in 'acquireNames'
+ *		rounds:  acquisitions to make
+ *		totalNs: time spent acquiring, summed over the rounds
+ *		worstNs: the longest single acquisition
+ */
+typedef struct {
+	int kind;
+	int rounds;
+	long long totalNs;
+	long long worstNs;
+} contender_t;
+
+SmartLock locks[BENCH_MAX];
+waiter_t waiters[BENCH_MAX];
+SmartIntentLock shared = SMARTINTENTLOCK_INITIALIZER;
+pthread_t exclusive;
+SmartLock contended;
+volatile unsigned long sectionWork;
+
+void bench_wake(waiter_t* waiter);
+void bench_build(int size);
+void bench_buildFan(int size);
+void bench_releaseFan(int size);
+void* bench_holdExclusive(void* arg);
+void bench_measure(SmartLock* first, SmartLock* second, unsigned long actor, int iterations,
+	double* checkNs, double* requestNs);
+double bench_report(SmartLock* lock, unsigned long actor, int iterations);
+void bench_readChecks(unsigned long long* checks, double* seconds);
+double bench_readMetric(const char* name);
+void bench_buildGraph(int kind, int nodes, int* offsets, int* targets);
+double bench_findCycles(const wait_graph_t* graph, int count, int* components, int* groups);
+void bench_acquire(int kind, int rounds, double* meanUs, double* worstUs);
+void* bench_contend(void* arg);
+long long bench_now();
+
+int main(int argc, char** argv) {
+
+	int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+
+	printf("%8s %14s %14s %14s %14s %14s %14s\n", "threads", "cycle_check", "cycle_request", "cycle_retry",
+		"cycle_report", "chain_check", "chain_request");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int size = sizes[i];
+		double cycleCheck, cycleRequest, cycleRetry, cycleReport, chainCheck, chainRequest;
+
+		bench_build(size);
+		bench_measure(&locks[0], &locks[1], size, iterations, &cycleCheck, &cycleRequest);
+		bench_measure(&locks[0], &locks[0], size, iterations, NULL, &cycleRetry);
+		cycleReport = bench_report(&locks[0], size, iterations);
+		cleanup();
+
+		bench_build(size - 1);
+		bench_measure(&locks[0], &locks[0], size, iterations, &chainCheck, &chainRequest);
+		cleanup();
+
+		printf("%8d %14.1f %14.1f %14.1f %14.1f %14.1f %14.1f\n", size, cycleCheck, cycleRequest, cycleRetry,
+			cycleReport, chainCheck, chainRequest);
+	}
+
+	printf("\n%8s %14s %14s %14s\n", "threads", "fan_check", "fan_request", "fan_report");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int size = sizes[i];
+		double fanCheck, fanRequest, fanReport;
+
+		bench_buildFan(size);
+		bench_measure(&locks[1], &locks[size - 1], 1, iterations, &fanCheck, &fanRequest);
+		fanReport = bench_report(&locks[1], 1, iterations);
+		bench_releaseFan(size);
+		cleanup();
+
+		printf("%8d %14.1f %14.1f %14.1f\n", size, fanCheck, fanRequest, fanReport);
+	}
+
+	printf("\n%8s %14s %14s\n", "acquire", "mean_us", "worst_us");
+	for (int kind = 0; kind < (int) (sizeof(acquireNames) / sizeof(acquireNames[0])); kind++) {
+		double meanUs, worstUs;
+		bench_acquire(kind, iterations / 100 > 0 ? iterations / 100 : 1, &meanUs, &worstUs);
+		printf("%8s %14.1f %14.1f\n", acquireNames[kind], meanUs, worstUs);
+	}
+
+	int nodes = argc > 2 ? atoi(argv[2]) : 1000000;
+	int* offsets = malloc((nodes + 1) * sizeof(int));
+	int* targets = malloc(4 * (size_t) nodes * sizeof(int) + sizeof(int));
+	int* components = malloc(nodes * sizeof(int));
+
+	printf("\n%8s %10s %10s %8s", "graph", "nodes", "edges", "groups");
+	for (size_t i = 0; i < sizeof(workers) / sizeof(workers[0]); i++) {
+		printf("     %2d_ms", workers[i]);
+	}
+	printf("\n");
+	for (int kind = 0; kind < (int) (sizeof(graphNames) / sizeof(graphNames[0])); kind++) {
+		bench_buildGraph(kind, nodes, offsets, targets);
+		wait_graph_t graph = { nodes, offsets, targets };
+
+		int groups = 0;
+		double ms[sizeof(workers) / sizeof(workers[0])];
+		for (size_t i = 0; i < sizeof(workers) / sizeof(workers[0]); i++) {
+			ms[i] = bench_findCycles(&graph, workers[i], components, &groups);
+		}
+
+		printf("%8s %10d %10d %8d", graphNames[kind], nodes, offsets[nodes], groups);
+		for (size_t i = 0; i < sizeof(workers) / sizeof(workers[0]); i++) {
+			printf(" %9.1f", ms[i]);
+		}
+		printf("\n");
+	}
+
+	free(offsets);
+	free(targets);
+	free(components);
+	return 0;
+}
+
+void bench_wake(waiter_t* waiter) {
+	(void) waiter;
+}
+
+//makes actors 1 to 'size' hold locks 0 to 'size' - 1, each waiting for the next lock
+void bench_build(int size) {
+
+	for (int i = 0; i < size; i++) {
+		init_lock(&locks[i]);
+		set_actor(i + 1);
+		lock_as(&locks[i], i + 1, NULL);
+	}
+	for (int i = 0; i + 1 < size; i++) {
+		waiters[i].wake = bench_wake;
+		waiters[i].wakeups = NULL;
+		set_actor(i + 1);
+		lock_as(&locks[i + 1], i + 1, &waiters[i]);
+	}
+	set_actor(0);
+}
+
+/*
+ * Makes actor i hold lock i - 1. Actor 1 is the requester, and actor 2 waits
+ * in another thread for MODE_X of 'shared', which the first actor of each
+ * chain holds in MODE_S. The other actors of a chain wait for the lock of the
+ * next one; the last chain ends waiting for the requester's lock. Actor
+ * 'size' waits for the lock of actor 2, so a request for either lock leads
+ * through the intent lock.
+ */
+void bench_buildFan(int size) {
+
+	int depth = (size - 3) / BENCH_FAN;
+	init_intent_lock(&shared);
+	for (int i = 0; i < 2 + BENCH_FAN * depth; i++) {
+		init_lock(&locks[i]);
+		set_actor(i + 1);
+		lock_as(&locks[i], i + 1, NULL);
+	}
+	init_lock(&locks[size - 1]);
+	set_actor(size);
+	lock_as(&locks[size - 1], size, NULL);
+	waiters[size - 1].wake = bench_wake;
+	waiters[size - 1].wakeups = NULL;
+	lock_as(&locks[1], size, &waiters[size - 1]);
+
+	for (int chain = 0; chain < BENCH_FAN; chain++) {
+		for (int i = 0; i < depth; i++) {
+			int actor = 3 + chain * depth + i;
+			set_actor(actor);
+			if (i == 0) {
+				trylock_mode(&shared, MODE_S);
+			}
+
+			SmartLock* next = i + 1 < depth ? &locks[actor] : chain + 1 == BENCH_FAN ? &locks[0] : NULL;
+			if (next != NULL) {
+				waiters[actor - 1].wake = bench_wake;
+				waiters[actor - 1].wakeups = NULL;
+				lock_as(next, actor, &waiters[actor - 1]);
+			}
+		}
+	}
+	set_actor(0);
+
+	//the request of the actor blocked in lock_mode() counts as a contention once queued
+	double contentions = bench_readMetric("smartlock_contentions_total");
+	pthread_create(&exclusive, NULL, bench_holdExclusive, NULL);
+	while (bench_readMetric("smartlock_contentions_total") == contentions) {
+		struct timespec pause = { 0, 100000 };
+		nanosleep(&pause, NULL);
+	}
+}
+
+//releases the MODE_S holds of bench_buildFan() so the blocked actor can finish
+void bench_releaseFan(int size) {
+
+	int depth = (size - 3) / BENCH_FAN;
+	for (int chain = 0; chain < BENCH_FAN; chain++) {
+		set_actor(3 + chain * depth);
+		unlock_mode(&shared);
+	}
+	set_actor(0);
+	pthread_join(exclusive, NULL);
+}
+
+void* bench_holdExclusive(void* arg) {
+	(void) arg;
+	set_actor(2);
+	if (lock_mode(&shared, MODE_X)) {
+		unlock_mode(&shared);
+	}
+	set_actor(0);
+	return NULL;
+}
+
+//requests 'first' and 'second' in turn as 'actor' without waiting, 'iterations' times;
+//the RAG is dropped with its parked requests by cleanup() afterwards
+void bench_measure(SmartLock* first, SmartLock* second, unsigned long actor, int iterations,
+	double* checkNs, double* requestNs) {
+
+	unsigned long long checksBefore, checksAfter;
+	double secondsBefore, secondsAfter;
+
+	set_actor(actor);
+	bench_readChecks(&checksBefore, &secondsBefore);
+	long long start = bench_now();
+
+	for (int i = 0; i < iterations; i++) {
+		lock_as(i % 2 == 0 ? first : second, actor, NULL);
+	}
+
+	long long end = bench_now();
+	bench_readChecks(&checksAfter, &secondsAfter);
+
+	set_actor(0);
+	if (checkNs != NULL) {
+		*checkNs = (secondsAfter - secondsBefore) * 1e9 / (checksAfter - checksBefore);
+	}
+	*requestNs = (double) (end - start) / iterations;
+}
+
+//requests 'lock' as 'actor' through track_request(), which finds the path of the
+//cycle as well; returns the time per cycle check
+double bench_report(SmartLock* lock, unsigned long actor, int iterations) {
+
+	unsigned long long checksBefore, checksAfter;
+	double secondsBefore, secondsAfter;
+	cycle_step_t cycle[BENCH_MAX];
+
+	set_actor(actor);
+	bench_readChecks(&checksBefore, &secondsBefore);
+
+	for (int i = 0; i < iterations; i++) {
+		int length = BENCH_MAX;
+		track_request(lock, cycle, &length);
+	}
+
+	bench_readChecks(&checksAfter, &secondsAfter);
+	set_actor(0);
+	return (secondsAfter - secondsBefore) * 1e9 / (checksAfter - checksBefore);
+}
+
+//reads the cycle check counters from the rendered metrics
+void bench_readChecks(unsigned long long* checks, double* seconds) {
+	*checks = bench_readMetric("smartlock_cycle_checks_total");
+	*seconds = bench_readMetric("smartlock_cycle_check_seconds_total");
+}
+
+//returns the value of the metric 'name', or 0 if it is not rendered
+double bench_readMetric(const char* name) {
+
+	char text[4096];
+	render_metrics(text, sizeof(text));
+
+	char key[128];
+	snprintf(key, sizeof(key), "\n%s ", name);
+	const char* line = strstr(text, key);
+	return line != NULL ? strtod(line + strlen(key), NULL) : 0;
+}
+
+long long bench_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+//fills 'offsets' and 'targets' with a graph of the kind at 'kind' in 'graphNames'
+void bench_buildGraph(int kind, int nodes, int* offsets, int* targets) {
+
+	srand(kind + 1);
+	int edges = 0;
+	int ringed = kind == 0 ? nodes / 100 : 0;
+
+	for (int i = 0; i < ringed; ) {
+		int size = 2 + rand() % 7;
+		if (i + size > ringed) {
+			size = ringed - i;
+		}
+		for (int j = 0; j < size; j++) {
+			offsets[i + j] = edges;
+			targets[edges++] = i + (j + 1) % size;
+		}
+		i += size;
+	}
+
+	for (int i = ringed; i < nodes; i++) {
+		offsets[i] = edges;
+		if (kind == 0) {
+			if (i > 0 && rand() % 8 != 0) {
+				targets[edges++] = rand() % i;
+			}
+		} else if (kind == 1) {
+			for (int held = rand() % 5; held > 0; held--) {
+				targets[edges++] = rand() % nodes;
+			}
+		} else {
+			targets[edges++] = (i + 1) % nodes;
+		}
+	}
+	offsets[nodes] = edges;
+}
+
+//returns the best time of find_cycles() on 'graph' with 'count' workers in ms
+double bench_findCycles(const wait_graph_t* graph, int count, int* components, int* groups) {
+
+	double best = 0;
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		long long start = bench_now();
+		*groups = find_cycles(graph, count, components);
+		double ms = (bench_now() - start) / 1e6;
+		if (run == 0 || ms < best) {
+			best = ms;
+		}
+	}
+	return best;
+}
+
+//runs BENCH_CONTENDERS threads taking 'contended' 'rounds' times each the way 'kind' says
+void bench_acquire(int kind, int rounds, double* meanUs, double* worstUs) {
+
+	pthread_t threads[BENCH_CONTENDERS];
+	contender_t contenders[BENCH_CONTENDERS];
+
+	init_lock(&contended);
+	for (int i = 0; i < BENCH_CONTENDERS; i++) {
+		contenders[i].kind = kind;
+		contenders[i].rounds = rounds;
+		pthread_create(&threads[i], NULL, bench_contend, &contenders[i]);
+	}
+
+	long long totalNs = 0;
+	long long worstNs = 0;
+	for (int i = 0; i < BENCH_CONTENDERS; i++) {
+		pthread_join(threads[i], NULL);
+		totalNs += contenders[i].totalNs;
+		if (contenders[i].worstNs > worstNs) {
+			worstNs = contenders[i].worstNs;
+		}
+	}
+	cleanup();
+
+	*meanUs = totalNs / 1e3 / ((double) rounds * BENCH_CONTENDERS);
+	*worstUs = worstNs / 1e3;
+}
+
+void* bench_contend(void* arg) {
+
+	contender_t* contender = arg;
+	retry_policy_t park = RETRY_POLICY_DEFAULT;
+	retry_policy_t backoff = RETRY_POLICY_DEFAULT;
+	backoff.flags = 0;
+
+	contender->totalNs = 0;
+	contender->worstNs = 0;
+	for (int round = 0; round < contender->rounds; round++) {
+		long long start = bench_now();
+		switch (contender->kind) {
+			case 0:
+				lock_retry(&contended, &park);
+				break;
+			case 1:
+				lock_retry(&contended, &backoff);
+				break;
+			default:
+				while (trylock(&contended) != LOCK_ACQUIRED);
+				break;
+		}
+		long long waited = bench_now() - start;
+
+		for (int i = 0; i < BENCH_SECTION; i++) {
+			sectionWork++;
+		}
+		unlock(&contended);
+
+		contender->totalNs += waited;
+		if (waited > contender->worstNs) {
+			contender->worstNs = waited;
+		}
+	}
+	release_actor(get_actor());
+	return NULL;
+}
@@ -0,0 +1,660 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "klock.h"
+
+/*
+ * Checks the cycle checks and find_cycles() against reference answers:
+ *		smartlock-check [trials]
+ * Each RAG trial gives random actors plain locks, shared holds of an intent
+ * lock and ranges of a range lock, then makes random requests. A request
+ * that waits parks, with helper threads waiting for the intent and range
+ * locks, so that later requests are checked against waits for several
+ * holders at once. Every answer is compared with a search of the test's own
+ * model of the wait-for graph: a request is rejected exactly when a holder
+ * of what it asks for reaches the requester. The trials are run with few
+ * actors, with more actors than the wait matrix has slots, and with few
+ * actors after many idle actors have taken the slots, as actors that are
+ * never released keep their nodes; the last two check the search the matrix
+ * falls back on. smartlock-check-dfs is built with WAIT_SLOTS=0, so all of
+ * its checks use that search.
+ * The track case reports two shadow locks taken without waiting, as a
+ * trylock does, while the watchdog runs, and checks that a request closing
+ * a cycle through them is refused.
+ * The exit case has more threads than the matrix has slots wait for a lock
+ * and exit, and checks that their nodes are gone once they are joined.
+ * The graph trials compare find_cycles() on random wait-for graphs, some
+ * large enough to be split around a pivot, with Tarjan's algorithm for 1, 2,
+ * 3 and 8 workers: a node must be on a cycle exactly when the reference
+ * says so, and two nodes must share a component exactly when they do there.
+ * Failures are printed, and the exit status is 1 if there were any.
+ */
+
+#define CHECK_ACTORS 192
+#define CHECK_IDLE 1000
+#define CHECK_LOCKS 16
+#define CHECK_RANGES 8
+#define CHECK_RANGE_BYTES 16
+#define CHECK_REQUESTS 64
+#define CHECK_EXITS 200
+
+enum {
+	false,
+	true
+};
+
+//what an actor of a RAG trial waits for
+enum {
+	WAIT_NONE,
+	WAIT_LOCK,
+	WAIT_TABLE,
+	WAIT_RANGE
+};
+
+/*
+ *	defines an actor of a RAG trial; it has:
+ *		waitKind:  one of the WAIT_* kinds
+ *		waitIndex: lock or range waited for
+ *		shared:    1 while it holds the intent lock in MODE_S
+ *		helper:    thread waiting for the intent or range lock as the actor
+ *		result:    what the helper's request returned
+ *		done:      1 once the helper's request has returned
+ */
+typedef struct {
+	int waitKind;
+	int waitIndex;
+	int shared;
+	pthread_t helper;
+	int result;
+	int done;
+} actor_t;
+
+const int workers[] = { 1, 2, 3, 8 };
+
+SmartLock locks[CHECK_LOCKS];
+SmartLock filler;
+SmartLock gate = SMARTLOCK_INITIALIZER;
+SmartIntentLock table = SMARTINTENTLOCK_INITIALIZER;
+SmartRangeLock file = SMARTRANGELOCK_INITIALIZER;
+waiter_t waiters[CHECK_ACTORS + 1];
+actor_t actors[CHECK_ACTORS + 1];
+unsigned long holders[CHECK_LOCKS];
+unsigned long rangeHolders[CHECK_RANGES];
+int actorCount;
+int idleCount;
+int failures = 0;
+
+void check_rag(int trial, int count, int idle);
+void check_request(int trial, unsigned long actor);
+_Bool check_reaches(unsigned long from, unsigned long to);
+int check_blockers(unsigned long actor, unsigned long* blockers);
+void check_park(unsigned long actor, int kind, int index);
+void* check_helper(void* arg);
+void check_finish();
+void check_track();
+void check_exits();
+void* check_exiter(void* arg);
+void check_wake(waiter_t* waiter);
+void check_graphs(int trial);
+void check_buildGraph(int kind, int nodes, int* offsets, int* targets);
+int check_tarjan(int nodes, const int* offsets, const int* targets, int* components);
+double check_readMetric(const char* name);
+
+int main(int argc, char** argv) {
+
+	int trials = argc > 1 ? atoi(argv[1]) : 20;
+
+	for (int trial = 0; trial < trials; trial++) {
+		check_rag(trial, 24, 0);
+		check_rag(trial, 160, 0);
+		check_rag(trial, 24, 140);
+		check_graphs(trial);
+	}
+
+	check_track();
+	check_exits();
+
+	printf("%d trials, %d failures\n", trials, failures);
+	return failures > 0;
+}
+
+void check_wake(waiter_t* waiter) {
+	(void) waiter;
+}
+
+/*
+ * Runs one RAG trial with actors 1 to 'count'. 'idle' actors first take a
+ * node each by finding a held lock busy, and keep it for the whole trial.
+ */
+void check_rag(int trial, int count, int idle) {
+
+	srand(trial * 3 + count + idle);
+	actorCount = count;
+	idleCount = idle;
+	memset(actors, 0, sizeof(actors));
+	memset(holders, 0, sizeof(holders));
+	memset(rangeHolders, 0, sizeof(rangeHolders));
+
+	init_lock(&filler);
+	init_intent_lock(&table);
+	init_range_lock(&file);
+	for (int i = 0; i < CHECK_LOCKS; i++) {
+		init_lock(&locks[i]);
+	}
+	for (int i = 0; i <= count; i++) {
+		waiters[i].wake = check_wake;
+		waiters[i].wakeups = NULL;
+	}
+
+	if (idle > 0) {
+		lock_as(&filler, CHECK_IDLE, NULL);
+		for (int i = 1; i <= idle; i++) {
+			lock_as(&filler, CHECK_IDLE + i, NULL);
+		}
+	}
+
+	//most plain locks and ranges are held, and a few actors share the intent lock
+	for (int i = 0; i < CHECK_LOCKS; i++) {
+		if (rand() % 5 != 0) {
+			holders[i] = 1 + rand() % count;
+			lock_as(&locks[i], holders[i], NULL);
+		}
+	}
+	for (int i = 0; i < CHECK_RANGES; i++) {
+		if (rand() % 5 != 0) {
+			rangeHolders[i] = 1 + rand() % count;
+			set_actor(rangeHolders[i]);
+			lock_range(&file, i * CHECK_RANGE_BYTES, CHECK_RANGE_BYTES);
+		}
+	}
+	for (int i = 1 + rand() % 4; i > 0; i--) {
+		unsigned long actor = 1 + rand() % count;
+		if (!actors[actor].shared) {
+			set_actor(actor);
+			trylock_mode(&table, MODE_S);
+			actors[actor].shared = true;
+		}
+	}
+	set_actor(0);
+
+	for (int i = 0; i < CHECK_REQUESTS; i++) {
+		unsigned long actor = 1 + rand() % count;
+		if (actors[actor].waitKind == WAIT_NONE) {
+			check_request(trial, actor);
+		}
+	}
+
+	check_finish();
+}
+
+//makes a random request as 'actor' and compares its answer with the model's
+void check_request(int trial, unsigned long actor) {
+
+	int kind = rand() % 4;
+	int index = 0;
+	unsigned long holder = 0;
+	int expected;
+
+	if (kind <= WAIT_LOCK) {
+		kind = WAIT_LOCK;
+		index = rand() % CHECK_LOCKS;
+		holder = holders[index];
+		expected = holder == 0 ? LOCK_ACQUIRED : check_reaches(holder, actor) ? LOCK_REJECTED : LOCK_PARKED;
+	} else if (kind == WAIT_TABLE) {
+		//an actor sharing the intent lock would upgrade instead; leave those out
+		if (actors[actor].shared) {
+			return;
+		}
+		expected = LOCK_PARKED;
+		for (unsigned long i = 1; i <= (unsigned long) actorCount; i++) {
+			if (actors[i].shared && check_reaches(i, actor)) {
+				expected = LOCK_REJECTED;
+			}
+		}
+		if (expected == LOCK_PARKED) {
+			int sharers = 0;
+			for (int i = 1; i <= actorCount; i++) {
+				sharers += actors[i].shared;
+			}
+			expected = sharers > 0 ? LOCK_PARKED : LOCK_ACQUIRED;
+		}
+		if (expected == LOCK_ACQUIRED) {
+			return;
+		}
+	} else {
+		index = rand() % CHECK_RANGES;
+		holder = rangeHolders[index];
+		if (holder == 0) {
+			set_actor(actor);
+			int result = lock_range(&file, index * CHECK_RANGE_BYTES, CHECK_RANGE_BYTES);
+			set_actor(0);
+			if (result != LOCK_ACQUIRED) {
+				printf("trial %d: actor %lu was refused free range %d: %d\n", trial, actor, index, result);
+				failures++;
+			} else {
+				rangeHolders[index] = actor;
+			}
+			return;
+		}
+		expected = check_reaches(holder, actor) ? LOCK_REJECTED : LOCK_PARKED;
+	}
+
+	int result;
+	if (kind == WAIT_LOCK) {
+		set_actor(actor);
+		result = lock_as(&locks[index], actor, &waiters[actor]);
+		set_actor(0);
+		if (result == LOCK_PARKED) {
+			actors[actor].waitKind = WAIT_LOCK;
+			actors[actor].waitIndex = index;
+		} else if (result == LOCK_ACQUIRED) {
+			holders[index] = actor;
+		}
+	} else {
+		check_park(actor, kind, index);
+		result = __atomic_load_n(&actors[actor].done, __ATOMIC_ACQUIRE) ? actors[actor].result : LOCK_PARKED;
+		if (result != LOCK_PARKED) {
+			pthread_join(actors[actor].helper, NULL);
+			actors[actor].waitKind = WAIT_NONE;
+		}
+	}
+
+	if ((result == LOCK_REJECTED) != (expected == LOCK_REJECTED)) {
+		printf("trial %d (%d actors, %d idle): actor %lu asking for %s %d got %d, expected %d\n", trial,
+			actorCount, idleCount, actor, kind == WAIT_LOCK ? "lock" : kind == WAIT_TABLE ? "table" : "range", index, result, expected);
+		failures++;
+	}
+}
+
+//returns whether 'from' waits, directly or through other actors, for 'to'
+_Bool check_reaches(unsigned long from, unsigned long to) {
+
+	_Bool visited[CHECK_ACTORS + 1] = { false };
+	unsigned long stack[CHECK_ACTORS + 1];
+	int depth = 0;
+
+	stack[depth++] = from;
+	visited[from] = true;
+	while (depth > 0) {
+		unsigned long actor = stack[--depth];
+		if (actor == to) {
+			return true;
+		}
+
+		unsigned long blockers[CHECK_ACTORS + 1];
+		int count = check_blockers(actor, blockers);
+		for (int i = 0; i < count; i++) {
+			if (!visited[blockers[i]]) {
+				visited[blockers[i]] = true;
+				stack[depth++] = blockers[i];
+			}
+		}
+	}
+	return false;
+}
+
+//writes the holders of what 'actor' waits for to 'blockers', returning how many there are
+int check_blockers(unsigned long actor, unsigned long* blockers) {
+
+	int count = 0;
+	switch (actors[actor].waitKind) {
+		case WAIT_LOCK:
+			blockers[count++] = holders[actors[actor].waitIndex];
+			break;
+		case WAIT_TABLE:
+			for (unsigned long i = 1; i <= (unsigned long) actorCount; i++) {
+				if (actors[i].shared && i != actor) {
+					blockers[count++] = i;
+				}
+			}
+			break;
+		case WAIT_RANGE:
+			blockers[count++] = rangeHolders[actors[actor].waitIndex];
+			break;
+	}
+	return count;
+}
+
+/*
+ * Starts a helper thread requesting the intent lock in MODE_X or the range
+ * at 'index' as 'actor', and returns once the request has either returned
+ * or been queued, which counts a contention.
+ */
+void check_park(unsigned long actor, int kind, int index) {
+
+	double contentions = check_readMetric("smartlock_contentions_total");
+	actors[actor].waitKind = kind;
+	actors[actor].waitIndex = index;
+	actors[actor].done = false;
+	pthread_create(&actors[actor].helper, NULL, check_helper, (void*) actor);
+
+	while (!__atomic_load_n(&actors[actor].done, __ATOMIC_ACQUIRE)
+		&& check_readMetric("smartlock_contentions_total") == contentions) {
+		struct timespec pause = { 0, 100000 };
+		nanosleep(&pause, NULL);
+	}
+}
+
+//requests what check_park() asked for, releasing it again if it is granted
+void* check_helper(void* arg) {
+
+	unsigned long actor = (unsigned long) arg;
+	actor_t* state = &actors[actor];
+	set_actor(actor);
+
+	int result;
+	if (state->waitKind == WAIT_TABLE) {
+		result = lock_mode(&table, MODE_X);
+		if (result == LOCK_ACQUIRED) {
+			unlock_mode(&table);
+		}
+	} else {
+		unsigned long long start = state->waitIndex * CHECK_RANGE_BYTES;
+		result = lock_range(&file, start, CHECK_RANGE_BYTES);
+		if (result == LOCK_ACQUIRED) {
+			unlock_range(&file, start, CHECK_RANGE_BYTES);
+		}
+	}
+
+	state->result = result;
+	__atomic_store_n(&state->done, true, __ATOMIC_RELEASE);
+	set_actor(0);
+	return NULL;
+}
+
+//releases the intent lock and the ranges so the helpers finish, then drops the RAG
+void check_finish() {
+
+	for (int i = 1; i <= actorCount; i++) {
+		if (actors[i].shared) {
+			set_actor(i);
+			unlock_mode(&table);
+		}
+	}
+	for (int i = 0; i < CHECK_RANGES; i++) {
+		if (rangeHolders[i] != 0) {
+			set_actor(rangeHolders[i]);
+			unlock_range(&file, i * CHECK_RANGE_BYTES, CHECK_RANGE_BYTES);
+		}
+	}
+	set_actor(0);
+
+	for (int i = 1; i <= actorCount; i++) {
+		if (actors[i].waitKind == WAIT_TABLE || actors[i].waitKind == WAIT_RANGE) {
+			pthread_join(actors[i].helper, NULL);
+		}
+	}
+	cleanup();
+}
+
+//reports two shadows through the track_* calls while the watchdog runs, which keeps locks off their fast path
+void check_track() {
+
+	SmartLock first = SMARTLOCK_INITIALIZER;
+	SmartLock second = SMARTLOCK_INITIALIZER;
+	cycle_step_t cycle[2];
+	int length;
+
+	start_watchdog(1000, 100, stderr);
+
+	set_actor(1);
+	track_acquired(&first);
+	set_actor(2);
+	track_acquired(&second);
+
+	set_actor(1);
+	length = 2;
+	if (!track_request(&second, cycle, &length)) {
+		printf("track: a request closing no cycle was refused\n");
+		failures++;
+	}
+	set_actor(2);
+	length = 2;
+	if (track_request(&first, cycle, &length) || length != 2) {
+		printf("track: a request closing a cycle was allowed, or reported %d steps\n", length);
+		failures++;
+	}
+
+	set_actor(2);
+	track_released(&second);
+	set_actor(1);
+	track_acquired(&second);
+	track_released(&second);
+	track_released(&first);
+	set_actor(0);
+
+	if (trylock(&first) != LOCK_ACQUIRED) {
+		printf("track: a released shadow is still held\n");
+		failures++;
+	} else {
+		unlock(&first);
+	}
+
+	stop_watchdog();
+	cleanup();
+}
+
+/*
+ * Has CHECK_EXITS threads wait for a lock held by the main thread, with the
+ * watchdog keeping them off the fast path so that each gets a node, then
+ * checks that the nodes were removed as the threads exited.
+ */
+void check_exits() {
+
+	pthread_t exiters[CHECK_EXITS];
+
+	start_watchdog(1000, 100, stderr);
+
+	lock(&gate);
+	double before = check_readMetric("smartlock_rag_threads");
+	for (int i = 0; i < CHECK_EXITS; i++) {
+		pthread_create(&exiters[i], NULL, check_exiter, NULL);
+	}
+	unlock(&gate);
+	for (int i = 0; i < CHECK_EXITS; i++) {
+		pthread_join(exiters[i], NULL);
+	}
+
+	double after = check_readMetric("smartlock_rag_threads");
+	if (after != before) {
+		printf("exits: %.0f thread nodes before the threads ran, %.0f after they exited\n", before, after);
+		failures++;
+	}
+
+	stop_watchdog();
+	cleanup();
+}
+
+//takes and releases the gate, then exits
+void* check_exiter(void* arg) {
+	if (lock(&gate) == LOCK_ACQUIRED) {
+		unlock(&gate);
+	}
+	return NULL;
+}
+
+//compares find_cycles() with check_tarjan() on graphs of each kind for 'trial'
+void check_graphs(int trial) {
+
+	for (int kind = 0; kind < 4; kind++) {
+		srand(trial * 4 + kind);
+		int nodes = kind == 3 ? 5000 + rand() % 20000 : 1 + rand() % (trial % 2 == 0 ? 60 : 3000);
+		int* offsets = malloc((nodes + 1) * sizeof(int));
+		int* targets = malloc(4 * (size_t) nodes * sizeof(int) + sizeof(int));
+		int* expected = malloc(nodes * sizeof(int));
+		int* components = malloc(nodes * sizeof(int));
+		int* map = malloc(nodes * sizeof(int));
+
+		check_buildGraph(kind, nodes, offsets, targets);
+		wait_graph_t graph = { nodes, offsets, targets };
+		int groups = check_tarjan(nodes, offsets, targets, expected);
+
+		for (size_t w = 0; w < sizeof(workers) / sizeof(workers[0]); w++) {
+			int found = find_cycles(&graph, workers[w], components);
+			if (found != groups) {
+				printf("graph %d/%d (%d nodes, %d workers): %d components, expected %d\n",
+					trial, kind, nodes, workers[w], found, groups);
+				failures++;
+				continue;
+			}
+
+			//each component found must map onto exactly one reference component
+			for (int i = 0; i < groups; i++) {
+				map[i] = -1;
+			}
+			for (int i = 0; i < nodes; i++) {
+				_Bool onCycle = components[i] >= 0;
+				if (onCycle != (expected[i] >= 0) || (onCycle && components[i] >= groups)
+					|| (onCycle && map[components[i]] >= 0 && map[components[i]] != expected[i])) {
+					printf("graph %d/%d (%d nodes, %d workers): node %d in component %d, expected %d\n",
+						trial, kind, nodes, workers[w], i, components[i], expected[i]);
+					failures++;
+					break;
+				}
+				if (onCycle) {
+					map[components[i]] = expected[i];
+				}
+			}
+		}
+
+		free(offsets);
+		free(targets);
+		free(expected);
+		free(components);
+		free(map);
+	}
+}
+
+/*
+ * Fills 'offsets' and 'targets' with a random graph of up to 4 edges a node:
+ *		0: 0 to 2 edges to any node
+ *		1: mostly one edge to a lower node, so cycles are rare self-waits
+ *		2: 0 to 4 edges to any node
+ *		3: one long cycle through most nodes, with some of its nodes also
+ *		   waiting at random, so the largest component needs the pivot
+ */
+void check_buildGraph(int kind, int nodes, int* offsets, int* targets) {
+
+	int edges = 0;
+	for (int i = 0; i < nodes; i++) {
+		offsets[i] = edges;
+		switch (kind) {
+			case 0:
+				for (int d = rand() % 3; d > 0; d--) {
+					targets[edges++] = rand() % nodes;
+				}
+				break;
+			case 1:
+				if (rand() % 8 != 0) {
+					targets[edges++] = rand() % (i + 1);
+				}
+				break;
+			case 2:
+				for (int d = rand() % 5; d > 0; d--) {
+					targets[edges++] = rand() % nodes;
+				}
+				break;
+			default:
+				if (rand() % 16 != 0) {
+					targets[edges++] = (i + 1) % nodes;
+				}
+				if (rand() % 4 == 0) {
+					targets[edges++] = rand() % nodes;
+				}
+				break;
+		}
+	}
+	offsets[nodes] = edges;
+}
+
+/*
+ * Numbers the strongly connected components that hold a cycle with Tarjan's
+ * algorithm, without recursion, writing each node's to 'components' or -1
+ * for a node on no cycle; returns the number of components.
+ */
+int check_tarjan(int nodes, const int* offsets, const int* targets, int* components) {
+
+	int* index = malloc(nodes * sizeof(int));
+	int* low = malloc(nodes * sizeof(int));
+	int* next = malloc(nodes * sizeof(int));
+	int* stack = malloc(nodes * sizeof(int));
+	int* calls = malloc(nodes * sizeof(int));
+	_Bool* onStack = calloc(nodes, sizeof(_Bool));
+	int counter = 0, depth = 0, groups = 0;
+
+	for (int i = 0; i < nodes; i++) {
+		index[i] = -1;
+	}
+
+	for (int root = 0; root < nodes; root++) {
+		if (index[root] >= 0) {
+			continue;
+		}
+		int top = 0;
+		calls[top++] = root;
+		index[root] = low[root] = counter++;
+		next[root] = offsets[root];
+		stack[depth++] = root;
+		onStack[root] = true;
+
+		while (top > 0) {
+			int node = calls[top - 1];
+			if (next[node] < offsets[node + 1]) {
+				int target = targets[next[node]++];
+				if (index[target] < 0) {
+					index[target] = low[target] = counter++;
+					next[target] = offsets[target];
+					stack[depth++] = target;
+					onStack[target] = true;
+					calls[top++] = target;
+				} else if (onStack[target] && index[target] < low[node]) {
+					low[node] = index[target];
+				}
+				continue;
+			}
+
+			top--;
+			if (top > 0 && low[node] < low[calls[top - 1]]) {
+				low[calls[top - 1]] = low[node];
+			}
+			if (low[node] != index[node]) {
+				continue;
+			}
+
+			//a component of one node is on a cycle only if the node waits for itself
+			_Bool isCycle = stack[depth - 1] != node;
+			for (int e = offsets[node]; e < offsets[node + 1] && !isCycle; e++) {
+				isCycle = targets[e] == node;
+			}
+			int member;
+			do {
+				member = stack[--depth];
+				onStack[member] = false;
+				components[member] = isCycle ? groups : -1;
+			} while (member != node);
+			groups += isCycle;
+		}
+	}
+
+	free(index);
+	free(low);
+	free(next);
+	free(stack);
+	free(calls);
+	free(onStack);
+	return groups;
+}
+
+//returns the value of the metric 'name', or 0 if it is not rendered
+double check_readMetric(const char* name) {
+
+	char text[4096];
+	render_metrics(text, sizeof(text));
+
+	char key[128];
+	snprintf(key, sizeof(key), "\n%s ", name);
+	const char* line = strstr(text, key);
+	return line != NULL ? strtod(line + strlen(key), NULL) : 0;
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <string.h>
+#include "klock.h"
+
+/*
+ * Converts files written by start_recording() to text, one event per line,
+ * or with -j to a JSON array of event objects:
+ *		smartlock-decode [-j] prefix.0 prefix.1 ...
+ * Events are printed in the order of each file, file after file.
+ */
+
+enum {
+	false,
+	true
+};
+
+const char* eventNames[] = { "request", "grant", "reject", "abandon", "release" };
+
+int main(int argc, char** argv) {
+
+	int json = argc > 1 && strcmp(argv[1], "-j") == 0;
+	int first = json ? 2 : 1;
+
+	if (argc <= first) {
+		fprintf(stderr, "usage: %s [-j] file...\n", argv[0]);
+		return 2;
+	}
+
+	int printed = 0;
+	if (json) {
+		printf("[");
+	}
+
+	for (int i = first; i < argc; i++) {
+		record_reader_t reader;
+		if (!open_recording(&reader, argv[i])) {
+			fprintf(stderr, "%s: not a recording\n", argv[i]);
+			return 1;
+		}
+		if (reader.dropped > 0) {
+			fprintf(stderr, "%s: %llu events were dropped while recording\n", argv[i], reader.dropped);
+		}
+
+		lock_record_t record;
+		while (read_record(&reader, &record)) {
+			const char* event = record.event < sizeof(eventNames) / sizeof(eventNames[0])
+				? eventNames[record.event] : "unknown";
+			if (json) {
+				printf("%s\n{\"ns\":%llu,\"thread\":%u,\"tid\":%llu,\"lock\":%llu,\"event\":\"%s\"}",
+					printed > 0 ? "," : "", record.ns, record.thread, record.tid, record.lock, event);
+			} else {
+				printf("%llu %u %llu %llu %s\n", record.ns, record.thread, record.tid, record.lock, event);
+			}
+			printed++;
+		}
+
+		close_recording(&reader);
+	}
+
+	if (json) {
+		printf("\n]\n");
+	}
+	return 0;
+}
@@ -4,24 +4,93 @@
 #include <unistd.h>
 #include <assert.h>
 #include <semaphore.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <string.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define PROFILE_SLOTS 1024
+#define PROFILE_DEPTH 32
+#define RECORD_RING 65536
+#define RECORD_CHUNK (1 << 20)
+#define RECORD_MAX 32
+#define RECORD_FLUSH_MS 10
+#define RECORD_VERSION 1
+#ifndef WAIT_SLOTS
+#define WAIT_SLOTS 128
+#endif
+#if defined(__AVX2__)
+#define WAIT_VECTOR 4
+#elif defined(__SSE2__)
+#define WAIT_VECTOR 2
+#else
+#define WAIT_VECTOR 1
+#endif
+#define WAIT_WORDS (((WAIT_SLOTS > 0 ? WAIT_SLOTS : 1) + 64 * WAIT_VECTOR - 1) / (64 * WAIT_VECTOR) * WAIT_VECTOR)
+#define WAIT_ROWS (WAIT_WORDS * 64)
+#define DETECT_BUFFER 256
+#define DETECT_NARROW 1024
+#define DETECT_SPLIT 4096
 
 enum {
 	false,
 	true
 };
 
+enum {
+	CHECK_REJECT,
+	CHECK_SKIP,
+	CHECK_WAIT
+};
+
+/*
+ *	defines a hold of an intent or range lock, or what a request for one
+ *	asks for; it has:
+ *		thread:   holding thread
+ *		mode:     mode an intent lock is held in
+ *		start:    first byte of a held range
+ *		end:      byte after a held range
+ *		acquired: when the hold began, while the watchdog runs
+ *		next:     next hold of the same lock; a range lock's are sorted by start
+ */
+typedef struct hold_t {
+	struct thread_t* thread;
+	int mode;
+	unsigned long long start;
+	unsigned long long end;
+	struct timespec acquired;
+	struct hold_t* next;
+} hold_t;
+
 /*
  *	defines a process node in the RAG; it has:
  * 		request:   current request edge
  *		next:      next thread in the thread list
  *		tid:			 associated thread ID
- *		travelled: 1 if seen during BFS; else 0
+ *		held:      number of assignment edges to the thread
+ *		since:     hold clock value when the thread last went from no locks to one
+ *		priority:  victim selection priority; lower is aborted first
+ *		wanted:    mode or range asked for by a request for an intent or range lock
+ *		slot:      row of the thread in the wait matrix, or -1 if every row was taken
  */
 typedef struct thread_t {
 	struct resource_t* request;
 	struct thread_t* next;
-	int tid;
-	_Bool travelled;
+	unsigned long tid;
+	int held;
+	unsigned long since;
+	int priority;
+	hold_t wanted;
+	int slot;
 } thread_t;
 
 /*
@@ -29,385 +98,4205 @@ typedef struct thread_t {
  *		assignment:  current assignment edge
  *		next:				 next resource in the resource list
  *		lock:				 address of associated lock
- *		travelled:	 1 if seen during BFS; else 0
+ *		sleepers:		 requesters whose blocked cycle runs through this resource
+ *		acquired:		 when the assignment edge was set, while the watchdog runs
+ *		holds:       holds of an intent or range lock, which has them instead of an assignment edge
+ *		kind:        one of the RESOURCE_* kinds
+ *		requesters:  number of request edges to the resource
  */
 typedef struct resource_t {
 	struct thread_t* assignment;
 	struct resource_t* next;
 	SmartLock* lock;
-	_Bool travelled;
+	struct wakeup_t* sleepers;
+	struct timespec acquired;
+	struct hold_t* holds;
+	int kind;
+	int requesters;
 } resource_t;
 
+/*
+ *	kinds of resource node:
+ *		RESOURCE_SINGLE: a SmartLock, held through its assignment edge
+ *		RESOURCE_INTENT: a SmartIntentLock, held in compatible modes
+ *		RESOURCE_RANGE:  a SmartRangeLock, held for disjoint byte ranges
+ */
+enum {
+	RESOURCE_SINGLE,
+	RESOURCE_INTENT,
+	RESOURCE_RANGE
+};
+
+/*
+ *	defines a thread on the path of a cycle search; it has:
+ *		thread:  thread whose outgoing edges are followed
+ *		hold:    next hold of its requested intent or range lock to follow
+ *		started: 1 once its first edge was followed
+ */
+typedef struct search_t {
+	struct thread_t* thread;
+	struct hold_t* hold;
+	_Bool started;
+} search_t;
+
+/*
+ *	whether a hold in the row's mode lets another thread hold the column's,
+ *	and the mode covering two holds of the same thread
+ */
+static const _Bool modeCompatible[4][4] = {
+	{ true,  true,  true,  false },
+	{ true,  true,  false, false },
+	{ true,  false, true,  false },
+	{ false, false, false, false }
+};
+static const int modeUnion[4][4] = {
+	{ MODE_IS, MODE_IX, MODE_S, MODE_X },
+	{ MODE_IX, MODE_IX, MODE_X, MODE_X },
+	{ MODE_S,  MODE_X,  MODE_S, MODE_X },
+	{ MODE_X,  MODE_X,  MODE_X, MODE_X }
+};
+static const char* modeNames[4] = { "IS", "IX", "S", "X" };
+
+/*
+ *	defines an entry of the wakeup index; it has:
+ *		waiter:   requester waiting for its request to become safe
+ *		resource: resource on the cycle that blocked the request
+ *		next:     next entry of the same resource
+ *		sibling:  next entry of the same waiter
+ */
+typedef struct wakeup_t {
+	struct waiter_t* waiter;
+	struct resource_t* resource;
+	struct wakeup_t* next;
+	struct wakeup_t* sibling;
+} wakeup_t;
+
 /*
  *	these components define a resource allocation graph
  *		threads: list of process nodes in the RAG
  *		resources: list of resouce nodes in the RAG
  */
-thread_t* threads = NULL;
-resource_t* resources = NULL;
+static thread_t* threads = NULL;
+static resource_t* resources = NULL;
+
+/*
+ *	these components define the wait matrix, with a row of bits for each thread slot
+ *		waitEdges:  bit j of row i is set while slot i waits for slot j
+ *		waitReach:  bit j of row i is set while slot i reaches slot j through waits
+ *		waitSlots:  slots given to thread nodes
+ *		waitThreads: thread node given each slot
+ *		unslotted:  thread nodes that found every slot taken
+ * The rows change with every edge, under the writer semaphore, so that while
+ * every thread has a slot a request closes a cycle exactly if its requester
+ * reaches itself.
+ */
+static unsigned long long waitEdges[WAIT_ROWS][WAIT_WORDS];
+static unsigned long long waitReach[WAIT_ROWS][WAIT_WORDS];
+static unsigned long long waitSlots[WAIT_WORDS];
+static thread_t* waitThreads[WAIT_ROWS];
+static int unslotted = 0;
+
+/*
+ *	number of nodes in each list, readable without the RAG semaphores
+ */
+static int threadCount = 0;
+static int resourceCount = 0;
+
+/*
+ *	released actor nodes, kept for reuse by new actors
+ */
+static thread_t* threadPool = NULL;
+
+/*
+ *	victim selection for cycles, and the clock ordering the threads' first holds
+ */
+static int victimPolicy = VICTIM_REQUESTER;
+static unsigned long holdClock = 0;
+
+/*
+ *	the actor the calling thread makes requests as; 0 means the thread itself
+ */
+static __thread unsigned long currentActor = 0;
+
+/*
+ *	key whose destructor removes an exiting thread's own node, freeing its
+ *	slot in the wait matrix, and whether the calling thread has set it
+ */
+static pthread_key_t threadKey;
+static __thread _Bool threadKeySet = false;
+
+/*
+ *	defines the last request of the calling thread that was rejected; it has:
+ *		tid:     RAG node that made it
+ *		lock:    lock it asked for
+ *		wanted:  mode or range asked for, for an intent or range lock
+ *		version: graph version once its request edge was removed
+ */
+typedef struct {
+	unsigned long tid;
+	SmartLock* lock;
+	hold_t wanted;
+	unsigned long long version;
+} rejection_t;
+
+/*
+ *	these components define the graph version, raised by every change to an
+ *	edge, so that a request rejected at one version is rejected again
+ *	without a cycle check while the version stays the same
+ *		graphVersion:   current version, raised under the writer semaphore
+ *		checkedVersion: version the calling thread's last cycle check saw
+ *		changedVersion: version the calling thread's last change raised it to
+ *		lastRejection:  the calling thread's last rejected request
+ */
+static unsigned long long graphVersion = 0;
+static __thread unsigned long long checkedVersion = 0;
+static __thread unsigned long long changedVersion = 0;
+static __thread rejection_t lastRejection;
+
+/*
+ *	defines the waiter of a thread blocked in lock(); it has:
+ *		waiter: queue entry handed to the lock
+ *		wakeup: posted when the lock is released or the request may be safe
+ */
+typedef struct blocked_t {
+	waiter_t waiter;
+	sem_t wakeup;
+} blocked_t;
+
+/*
+ *	defines an entry of the contention profile; it has:
+ *		lock:   contended lock
+ *		depth:  number of frames in 'frames'
+ *		frames: call stack of the contended request, innermost first
+ *		count:  number of samples with this lock and stack
+ *		waitNs: total time those samples waited
+ */
+typedef struct profile_t {
+	SmartLock* lock;
+	int depth;
+	void* frames[PROFILE_DEPTH];
+	unsigned long count;
+	unsigned long long waitNs;
+} profile_t;
+
+/*
+ *	these components define the sampling contention profiler
+ *		profile:       open-addressed table of samples keyed by lock and stack
+ *		profileRate:   1 in this many contended requests is sampled; 0 for none
+ *		profileCount:  contended requests made by the calling thread
+ */
+static profile_t profile[PROFILE_SLOTS];
+static unsigned int profileRate = 0;
+static __thread unsigned long profileCount = 0;
+static sem_t profile_mutex;
+
+/*
+ *	defines the header at the start of each recording file; it has:
+ *		magic:    "SLOG"
+ *		version:  RECORD_VERSION
+ *		thread:   index of the recording thread, also the file's suffix
+ *		tid:      RAG node of the recording thread
+ *		base:     CLOCK_MONOTONIC time in ns the first event's delta is from
+ *		dropped:  events lost because the thread's ring was full
+ * Each event follows as varints: the event type, with RECORD_FOREIGN set if
+ * the event concerns another RAG node than the thread's; the time since the
+ * previous event in ns; the lock's id; and, if foreign, that RAG node.
+ */
+typedef struct record_header_t {
+	char magic[4];
+	unsigned int version;
+	unsigned int thread;
+	unsigned int reserved;
+	unsigned long long tid;
+	unsigned long long base;
+	unsigned long long dropped;
+} record_header_t;
+
+enum {
+	RECORD_FOREIGN = 8
+};
+
+/*
+ *	defines the event stream of one thread; it has:
+ *		ring:       encoded events not yet written, from tail to head
+ *		head:       bytes ever added to the ring, advanced by the thread
+ *		tail:       bytes ever written from the ring, advanced by the writer
+ *		header:     header of the stream's file
+ *		last:       time of the thread's previous event
+ *		generation: recording the stream belongs to
+ *		fd:         the stream's file, or -1 until the writer opens it
+ *		failed:     1 if the file could not be opened or grown
+ *		file:       the file mapped into memory
+ *		used:       bytes written to the file
+ *		capacity:   bytes the file has room for before it must grow
+ *		retired:    1 once its thread has moved on to a later recording
+ *		next:       next stream in the recorder list
+ */
+typedef struct recorder_t {
+	unsigned char ring[RECORD_RING];
+	size_t head;
+	size_t tail;
+	record_header_t header;
+	unsigned long long last;
+	unsigned int generation;
+	int fd;
+	_Bool failed;
+	unsigned char* file;
+	size_t used;
+	size_t capacity;
+	_Bool retired;
+	struct recorder_t* next;
+} recorder_t;
+
+/*
+ *	these components define the event recorder
+ *		recorders:         streams of the threads that recorded, pushed without a lock
+ *		                   and removed under record_mutex
+ *		recordPrefix:      path the files are named after
+ *		recording:         1 between start_recording() and stop_recording()
+ *		recordGeneration:  number of start_recording() calls, to retire old streams
+ *		recordFiles:       streams started since start_recording()
+ *		recordWriter:      thread that moves events from the rings to the files
+ *		recordStop:        posted to stop the writer
+ *		recordKey:         key whose destructor writes out and frees an exiting
+ *		                   thread's stream
+ *		currentRecorder:   stream of the calling thread
+ */
+static recorder_t* recorders = NULL;
+static char* recordPrefix = NULL;
+static int recording = false;
+static unsigned int recordGeneration = 0;
+static unsigned int recordFiles = 0;
+static pthread_t recordWriter;
+static sem_t recordStop;
+static sem_t record_mutex;
+static pthread_key_t recordKey;
+static __thread recorder_t* currentRecorder = NULL;
+static unsigned int lockIds = 0;
+
+/*
+ *	defines the lock statistics of one thread; it has:
+ *		acquisitions: locks granted
+ *		contentions:  requests that found their lock held
+ *		rejections:   requests rejected or aborted to prevent a deadlock
+ *		cycleChecks:  cycle checks made for requests
+ *		cycleCheckNs: time spent in those checks
+ *		repeated:     rejections repeated without a cycle check
+ *		next:         next thread's statistics
+ * Only the thread itself writes them, so render_metrics() can read them
+ * while locks are in use.
+ */
+typedef struct stats_t {
+	unsigned long long acquisitions;
+	unsigned long long contentions;
+	unsigned long long rejections;
+	unsigned long long cycleChecks;
+	unsigned long long cycleCheckNs;
+	unsigned long long repeated;
+	struct stats_t* next;
+} stats_t;
+
+/*
+ *	these components define the lock statistics
+ *		statsList:    statistics of every running thread that used a lock
+ *		statsRetired: sums of the statistics of the threads that exited
+ *		statsKey:     key whose destructor folds an exiting thread's statistics
+ *		              into statsRetired and frees them
+ *		stats_mutex:  guards statsList and statsRetired
+ *		currentStats: statistics of the calling thread
+ */
+static stats_t* statsList = NULL;
+static stats_t statsRetired;
+static pthread_key_t statsKey;
+static sem_t stats_mutex;
+static __thread stats_t* currentStats = NULL;
+
+static pthread_once_t setupOnce = PTHREAD_ONCE_INIT;
+static sem_t assign_mutex;
+static sem_t assign_mutexRw;
+static int   assign_readers = 0;
+
+/*
+ *	these components define the long-hold watchdog
+ *		watchdogRunning:  1 while the watchdog thread samples the RAG
+ *		watchdogStop:     posted to stop the watchdog thread
+ *		watchdogOut:      stream reports are written to
+ *		watchdogThreshold: hold time in ms after which a hold is reported
+ *		watchdogPeriod:   time in ms between samples
+ */
+static _Bool watchdogRunning = false;
+static pthread_t watchdogThread;
+static sem_t watchdogStop;
+static FILE* watchdogOut = NULL;
+static long watchdogThreshold = 0;
+static long watchdogPeriod = 0;
 
-_Bool firstRun = true;
-sem_t assign_mutex;
-sem_t assign_mutexRw;
-int   assign_readers = 0;
+/*
+ *	marks of a node in find_cycles():
+ *		DETECT_TRIMMED:  on no cycle, as nothing left waits for it
+ *		DETECT_FORWARD:  reached by the pivot
+ *		DETECT_BACKWARD: reaches the pivot
+ *		DETECT_DONE:     given its component by the pivot search
+ *		DETECT_STACKED:  on the stack of the component search of its part
+ */
+enum {
+	DETECT_TRIMMED = 1,
+	DETECT_FORWARD = 2,
+	DETECT_BACKWARD = 4,
+	DETECT_DONE = 8,
+	DETECT_STACKED = 16
+};
+
+/*
+ *	defines a run of find_cycles(), shared by its workers; it has:
+ *		graph:          wait-for graph searched
+ *		components:     component of each node, the result
+ *		count:          number of components found
+ *		workers:        number of workers
+ *		barrier:        ends each phase of the run
+ *		inDegree:       edges to each node from nodes not yet trimmed
+ *		reverseOffsets: start of each node's edges in 'reverseTargets'
+ *		reverseTargets: node each edge between nodes left comes from, grouped
+ *		                by the node it leads to, for the pivot search
+ *		marks:          DETECT_* marks of each node
+ *		live:           number of nodes left after trimming
+ *		pivots:         best pivot in each worker's nodes, or -1
+ *		pivot:          node the pivot search starts from, or -1 to skip it
+ *		pivotSize:      nodes both reached by and reaching the pivot
+ *		pivotComponent: component of those nodes
+ *		frontier:       nodes reached in the last level of the pivot search
+ *		next:           nodes reached in the current level
+ *		frontierSize:   number of nodes in 'frontier'
+ *		nextSize:       number of nodes in 'next'
+ *		parents:        union-find forest joining the nodes left into parts
+ *		order:          nodes left, grouped by part
+ *		partStarts:     start of each part in 'order', then the end of the last
+ *		parts:          number of parts
+ *		nextPart:       next part for a worker to search
+ *		index:          order each node was entered in by the search of its part, or -1
+ *		lowlink:        lowest index each node's subtree reaches on the stack
+ *		cursor:         next edge of each node to follow
+ *		stack:          nodes of components not yet complete, at the start of their part
+ *		calls:          path of the search, at the start of its part
+ * Nodes on no cycle are trimmed first. With many nodes left, a component
+ * too large to leave to one worker is found by a parallel search from the
+ * pivot; the other components fall apart into parts no edge joins, which
+ * the workers share out.
+ */
+typedef struct {
+	const wait_graph_t* graph;
+	int* components;
+	int count;
+	int workers;
+	pthread_barrier_t barrier;
+	int* inDegree;
+	int* reverseOffsets;
+	int* reverseTargets;
+	int* marks;
+	int live;
+	int* pivots;
+	int pivot;
+	int pivotSize;
+	int pivotComponent;
+	int* frontier;
+	int* next;
+	int frontierSize;
+	int nextSize;
+	int* parents;
+	int* order;
+	int* partStarts;
+	int parts;
+	int nextPart;
+	int* index;
+	int* lowlink;
+	int* cursor;
+	int* stack;
+	int* calls;
+} detect_t;
+
+/*
+ *	defines a worker of find_cycles(); it has:
+ *		run:    the run it works on
+ *		worker: its number; the caller of find_cycles() is worker 0
+ *		thread: thread running it
+ */
+typedef struct {
+	detect_t* run;
+	int worker;
+	pthread_t thread;
+} detect_worker_t;
 
+int lock_wait(SmartLock* lock, unsigned long tid, int check, const struct timespec* abstime,
+	cycle_step_t* cycle, int* length);
+int lock_request(SmartLock* lock, unsigned long tid, waiter_t* waiter, int check,
+	cycle_step_t* cycle, int* length);
+_Bool lock_sleep(blocked_t* blocked, const struct timespec* abstime);
+_Bool lock_backoff(const retry_policy_t* policy, long bound, unsigned int* seed);
+int lock_abandon(SmartLock* lock, unsigned long tid, blocked_t* blocked);
+int lock_waitHold(SmartLock* lock, int kind, hold_t* wanted);
+int lock_tryHold(SmartLock* lock, int kind, hold_t* wanted);
+_Bool lock_setRange(hold_t* range, unsigned long long start, unsigned long long length);
+int lock_requestHold(SmartLock* lock, unsigned long tid, int kind, hold_t* wanted, waiter_t* waiter);
+void lock_wakeNext(SmartLock* lock);
+_Bool lock_isRejected(SmartLock* lock, unsigned long tid, hold_t* wanted);
+void lock_rememberRejection(SmartLock* lock, unsigned long tid, hold_t* wanted, unsigned long long checked);
+_Bool lock_tryFast(SmartLock* lock, unsigned long tid);
+_Bool lock_releaseFast(SmartLock* lock);
+unsigned int lock_getId(SmartLock* lock);
+_Bool profile_shouldSample();
+void profile_record(SmartLock* lock, void** frames, int depth, struct timespec* start);
+void profile_printFrame(FILE* out, const char* symbol);
+void record_event(SmartLock* lock, unsigned long tid, int event);
+stats_t* stats_get();
+void stats_retire(void* stats);
+void stats_add(unsigned long long* counter, unsigned long long amount);
+recorder_t* record_getRecorder();
+void record_retire(void* recorder);
+void record_sweep();
+void record_unlink(recorder_t* recorder);
+int record_putVarint(unsigned char* out, unsigned long long value);
+_Bool record_getVarint(FILE* in, unsigned long long* value);
+void* record_writer(void* arg);
+void record_flush();
+void record_drain(recorder_t* recorder);
+_Bool record_grow(recorder_t* recorder, size_t needed);
+void record_close(recorder_t* recorder);
+void rag_setup();
+void rag_createSemaphores();
 struct resource_t* rag_createResource();
 struct thread_t* rag_createThread();
-void rag_addResource();
+void rag_register(SmartLock* lock);
 void rag_addThread();
+void rag_linkResource(resource_t* newResource);
+void rag_linkThread(thread_t* newThread);
+_Bool rag_removeThread(unsigned long tid);
+void rag_exitThread(void* arg);
+void rag_removeResource(SmartLock* lock);
 resource_t* rag_getResource(SmartLock* lock);
-thread_t* rag_getThread(int tid);
+thread_t* rag_getThread(unsigned long tid);
 _Bool rag_isAssigned();
-void rag_setRequest(int tid, SmartLock* lock);
-void rag_setAssignment(int tid, SmartLock* lock);
-void rag_removeRequest(int tid);
-void rag_removeAssignment(SmartLock* lock);
+void rag_setRequest(unsigned long tid, SmartLock* lock);
+void rag_setHoldRequest(unsigned long tid, SmartLock* lock, hold_t* wanted);
+_Bool rag_tryAssignment(unsigned long tid, SmartLock* lock, waiter_t* waiter);
+_Bool rag_tryHold(unsigned long tid, SmartLock* lock, int kind, hold_t* wanted, waiter_t* waiter);
+waiter_t* rag_releaseHold(unsigned long tid, SmartLock* lock, hold_t* released);
+hold_t* rag_getHold(resource_t* resource, thread_t* thread);
+_Bool rag_isInWay(resource_t* resource, hold_t* hold, hold_t* wanted);
+void rag_queueWaiter(SmartLock* lock, unsigned long tid, waiter_t* waiter);
+void rag_setHolder(resource_t* resource, thread_t* holder);
+void* rag_watchdog(void* arg);
+void rag_reportLongHolds();
+void rag_reportHold(resource_t* resource, thread_t* holder, hold_t* hold, long heldMs);
+void rag_removeRequest(unsigned long tid);
+waiter_t* rag_removeAssignment(SmartLock* lock);
+waiter_t* rag_takeWaiter(SmartLock* lock);
+_Bool rag_cancelWaiter(SmartLock* lock, waiter_t* waiter);
+void rag_wakeThread(waiter_t* waiter);
+void rag_wakeAll(waiter_t* woken);
+_Bool rag_parkUnsafe(unsigned long tid, waiter_t* waiter);
+void rag_indexWaiter(thread_t* requester, waiter_t* waiter);
+void rag_unindexWaiter(waiter_t* waiter);
+waiter_t* rag_takeSleepers(resource_t* resource);
 void rag_readerWait();
 void rag_readerSignal();
 void rag_writerWait();
 void rag_writerSignal();
 _Bool rag_isNewThread();
 _Bool rag_checkForCycles();
-_Bool rag_depthFirstSearch(thread_t* currentNode);
+int rag_recordCycle(thread_t* requester, cycle_step_t* cycle, int capacity);
+_Bool rag_abortVictim(unsigned long tid);
+_Bool rag_isBetterVictim(thread_t* candidate, thread_t* victim);
+_Bool rag_closesCycle(thread_t* requester);
+int rag_findCycle(thread_t* requester, thread_t** cycle, int capacity);
+thread_t* rag_nextBlocker(search_t* search);
+_Bool rag_markVisited(thread_t** visited, int slots, thread_t* thread);
+void rag_clearRequest(thread_t* thread);
+void rag_updateRequesters(resource_t* resource);
+void rag_updateWaits(thread_t* thread);
+_Bool rag_orderReach(const unsigned long long* affected);
+void rag_closeReach(int slot, const unsigned long long* affected);
+void rag_takeSlot(thread_t* thread);
+void rag_freeSlot(thread_t* thread);
+_Bool rag_hasSlot(const unsigned long long* row, int slot);
+int rag_searchWaits(thread_t* requester, thread_t** cycle, int capacity);
+void rag_orRow(unsigned long long* row, const unsigned long long* other);
+_Bool rag_advanceFrontier(unsigned long long* frontier, const unsigned long long* next, unsigned long long* reach);
+int rag_countThreads();
+void rag_changeGraph();
+void* detect_worker(void* arg);
+void detect_run(detect_t* run, int worker);
+_Bool detect_barrier(detect_t* run);
+void detect_range(detect_t* run, int worker, int count, int* first, int* last);
+_Bool detect_claim(detect_t* run, int node, int mark);
+_Bool detect_isLive(detect_t* run, int node);
+void detect_countEdges(detect_t* run, int worker);
+void detect_sumDegrees(detect_t* run);
+void detect_reverseEdges(detect_t* run, int worker);
+void detect_trim(detect_t* run, int worker);
+void detect_findPivot(detect_t* run, int worker);
+void detect_pickPivot(detect_t* run);
+void detect_splitPivot(detect_t* run, int worker);
+void detect_search(detect_t* run, int worker, int mark, const int* offsets, const int* targets);
+void detect_expand(detect_t* run, int first, int last, int mark, const int* offsets, const int* targets);
+void detect_swapFrontier(detect_t* run);
+void detect_joinParts(detect_t* run, int worker);
+int detect_find(detect_t* run, int node);
+void detect_union(detect_t* run, int first, int second);
+void detect_groupParts(detect_t* run);
+void detect_searchPart(detect_t* run, int part);
+void detect_enter(detect_t* run, int node, int* counter, int* stack, int* stacked);
+void detect_popComponent(detect_t* run, int node, int* stack, int* stacked);
+_Bool detect_waitsForItself(const wait_graph_t* graph, int node);
+int detect_slot(thread_t** table, int slots, thread_t* thread);
 
 //initializes a SmartLock object with default values
 void init_lock(SmartLock* lock) {
 
-	//if being run for first time, create needed semaphores
-	if (firstRun) {
-		firstRun = false;
-		sem_init(&assign_mutex,   0, 1);
-		sem_init(&assign_mutexRw, 0, 1);
-	}
+	//initialize lock; it joins the RAG once a request finds it held
+	lock->held = false;
+	lock->handoff = false;
+	lock->waiters = NULL;
+	lock->id = 0;
+	lock->owner = 0;
+}
+
+/*
+ * Turns handoff mode on or off for a SmartLock. In handoff mode, unlock()
+ * gives the lock and its assignment edge straight to the oldest waiter,
+ * whose request already passed the cycle check, instead of freeing the
+ * lock and letting the waiter retry its request.
+ */
+void set_handoff(SmartLock* lock, int enabled) {
+	rag_setup();
+	rag_writerWait();
+	lock->handoff = enabled;
+	rag_writerSignal();
+}
 
-	//initialize lock and add it to RAG
-	pthread_mutex_init(&(lock->mutex), NULL);
-	rag_addResource(lock);
+//removes an unused SmartLock object from the RAG
+void destroy_lock(SmartLock* lock) {
+	if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) == LOCK_REGISTERED) {
+		rag_removeResource(lock);
+	}
 }
 
 //performs a mutually exclusive lock on a SmartLock
 int lock(SmartLock* lock) {
+	return lock_wait(lock, get_actor(), CHECK_REJECT, NULL, NULL, NULL);
+}
 
-	//get the calling thread's id
-	int tid = pthread_self();
+/*
+ * Performs a lock on a SmartLock like lock(). If the lock is rejected, the
+ * cycle it would have closed is written to 'cycle', starting with the
+ * caller's own request; the lock in the last step is held by the caller, so
+ * releasing it breaks the cycle. '*length' gives the capacity of 'cycle' on
+ * entry and the length of the whole cycle on return; like snprintf(), only
+ * the first steps are written when that is more than the capacity, and the
+ * last step is then missing.
+ */
+int lock_ex(SmartLock* lock, cycle_step_t* cycle, int* length) {
+	return lock_wait(lock, get_actor(), CHECK_REJECT, NULL, cycle, length);
+}
 
-	//if the thread is new, add it to the threads list
-	if (rag_isNewThread(tid)) {
-		rag_addThread(tid);
+/*
+ * Performs a lock on a SmartLock the caller knows it takes in a safe order.
+ * The RAG edges are still kept for other requesters, but the cycle check
+ * is skipped.
+ */
+int lock_ordered(SmartLock* lock) {
+	return lock_wait(lock, get_actor(), CHECK_SKIP, NULL, NULL, NULL);
+}
+
+/*
+ * Performs a lock on a SmartLock like lock(), but a request that would
+ * create a cycle waits until a change to that cycle makes it safe instead
+ * of being rejected. Returns 0 if 'abstime' (CLOCK_REALTIME) passes before
+ * the lock is acquired. The cycle runs through a lock the caller holds, so
+ * if the other threads on it wait in lock() nothing may ever change it; a
+ * NULL 'abstime' therefore rejects an unsafe request at once, as lock()
+ * does, rather than waiting forever.
+ */
+int lock_timed(SmartLock* lock, const struct timespec* abstime) {
+	int check = abstime != NULL ? CHECK_WAIT : CHECK_REJECT;
+	return lock_wait(lock, get_actor(), check, abstime, NULL, NULL);
+}
+
+/*
+ * Performs a lock on a SmartLock, retrying after each rejection with a
+ * randomized backoff that doubles its bound every attempt, as described by
+ * 'policy'. Returns 0 once the attempts run out or the deadline passes.
+ */
+int lock_retry(SmartLock* lock, const retry_policy_t* policy) {
+
+	unsigned long tid = get_actor();
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	unsigned int seed = tid ^ now.tv_nsec;
+
+	//a parked attempt gives up at the deadline as well
+	const struct timespec* abstime = NULL;
+	if (policy->deadline.tv_sec != 0 || policy->deadline.tv_nsec != 0) {
+		abstime = &policy->deadline;
 	}
 
-	//since the lock isn't already given, set a request edge
-	rag_setRequest(tid, lock);
+	//a bound of 0 would never grow, and the attempts would spin without pausing
+	long bound = policy->base_ns > 0 ? policy->base_ns : 1;
+	long max = policy->max_ns > bound ? policy->max_ns : bound;
+	for (int attempt = 1; ; attempt++) {
+		int result;
+		if (policy->flags & RETRY_PARK) {
+			result = lock_wait(lock, tid, CHECK_REJECT, abstime, NULL, NULL);
+		} else {
+			result = lock_as(lock, tid, NULL);
+		}
+		if (result == LOCK_ACQUIRED) {
+			return 1;
+		}
+		if (policy->max_attempts > 0 && attempt >= policy->max_attempts) {
+			return 0;
+		}
+		if (!lock_backoff(policy, bound, &seed)) {
+			return 0;
+		}
+		bound = bound > max / 2 ? max : bound * 2;
+	}
+}
 
-	//if the lock creates no cycles, give it to the thread
-	if (!rag_checkForCycles(tid)) {
+/*
+ * Tracks a primitive other than a SmartLock, such as a pthread mutex, in the
+ * RAG through a shadow SmartLock that is never locked itself. The caller
+ * reports each step around its own acquisition:
+ *		track_request:  before waiting; sets a request edge and returns 0,
+ *		                writing the cycle as lock_ex() does, if waiting
+ *		                would deadlock
+ *		track_acquired: once acquired; sets the assignment edge
+ *		track_released: before releasing; removes the assignment edge
+ *		track_abandoned: if the primitive was not acquired after all
+ */
+int track_request(SmartLock* shadow, cycle_step_t* cycle, int* length) {
 
-		printf("%lu locking\n", pthread_self());
-		rag_setAssignment(tid, lock);
-		pthread_mutex_lock(&(lock->mutex));
+	unsigned long tid = get_actor();
+	record_event(shadow, tid, RECORD_REQUEST);
+	rag_register(shadow);
+	if (rag_isNewThread(tid)) {
+		rag_addThread(tid);
 	}
-	//if a cycle is detected, reject the thread
-	else {
+
+	rag_setRequest(tid, shadow);
+	if (rag_checkForCycles(tid, cycle, length)) {
 		rag_removeRequest(tid);
+		stats_add(&stats_get()->rejections, 1);
+		record_event(shadow, tid, RECORD_REJECT);
 		return 0;
 	}
-	//remove the request edge now that assignment is created
-	rag_removeRequest(tid);
 	return 1;
 }
 
-//unlocks a given SmartLock object
-void unlock(SmartLock* lock) {
-
-	//remove the assignment edge associating the lock with a thread
-	rag_removeAssignment(lock);
-	pthread_mutex_unlock(&(lock->mutex));
-}
-
-/*
- * Cleanup any dynamic allocated memory for SmartLock to avoid memory leak
- * You can assume that cleanup will always be the last function call
- * in main function of the test cases.
- */
-void cleanup() {
+void track_acquired(SmartLock* shadow) {
 
-	//iterate through and release each resource object
-	struct resource_t* temp_res = resources;
-	for (struct resource_t* curr = resources; temp_res != NULL; curr = temp_res) {
-		temp_res = curr->next;
-		free(curr);
+	unsigned long tid = get_actor();
+	if (lock_tryFast(shadow, tid)) {
+		stats_add(&stats_get()->acquisitions, 1);
+		record_event(shadow, tid, RECORD_GRANT);
+		return;
 	}
 
-	//iterate through and release each thread object
-	struct thread_t* temp_thr = threads;
-	for (struct thread_t* curr = threads; temp_thr != NULL; curr = temp_thr) {
-		temp_thr = curr->next;
-		free(curr);
+	//a primitive taken without waiting, such as by a trylock, has no request yet
+	rag_register(shadow);
+	if (rag_isNewThread(tid)) {
+		rag_addThread(tid);
 	}
+
+	rag_tryAssignment(tid, shadow, NULL);
+	rag_removeRequest(tid);
+	stats_add(&stats_get()->acquisitions, 1);
+	record_event(shadow, tid, RECORD_GRANT);
 }
 
-//creates a new resource node in a RAG with default parameters
-struct resource_t* rag_createResource() {
-	struct resource_t* newResource = malloc(sizeof(resource_t));
-	newResource->assignment = NULL;
-	newResource->lock = NULL;
-	newResource->next = NULL;
-	newResource->travelled = false;
-	return newResource;
+void track_released(SmartLock* shadow) {
+	record_event(shadow, get_actor(), RECORD_RELEASE);
+	if (!lock_releaseFast(shadow)) {
+		rag_wakeAll(rag_removeAssignment(shadow));
+	}
 }
 
-//creates a new process node in a RAG with default parameters
-struct thread_t* rag_createThread() {
-	struct thread_t* newThread = malloc(sizeof(thread_t));
-	newThread->request = NULL;
-	newThread->tid = 0;
-	newThread->next = NULL;
-	newThread->travelled = false;
-	return newThread;
+void track_abandoned(SmartLock* shadow) {
+	rag_setup();
+	if (!rag_isNewThread(get_actor())) {
+		rag_removeRequest(get_actor());
+	}
+	record_event(shadow, get_actor(), RECORD_ABANDON);
 }
 
-//adds a new resource to the resource list in the RAG
-void rag_addResource(SmartLock* lock) {
-	struct resource_t* newResource = rag_createResource();
+/*
+ * Initializes an array of 'count' lock stripes in a single allocation. Each
+ * stripe is a SmartLock that joins the RAG only once it is contended, so
+ * stripes that never are cost their 32 bytes and no RAG nodes. Returns 0
+ * if the stripes cannot be allocated.
+ */
+int init_lock_array(SmartLockArray* array, unsigned int count) {
 
-	rag_writerWait();
+	//a zeroed SmartLock is the same as one set up by init_lock()
+	array->stripes = calloc(count, sizeof(SmartLock));
+	array->count = array->stripes != NULL ? count : 0;
+	return array->stripes != NULL;
+}
 
-	if (resources != NULL) {
-		struct resource_t* curr = resources;
-		while (curr->next != NULL) {
-			curr = curr->next;
-		}
-		curr->next = newResource;
-	} else {
-		resources = newResource;
+void destroy_lock_array(SmartLockArray* array) {
+	for (unsigned int i = 0; i < array->count; i++) {
+		destroy_lock(&array->stripes[i]);
 	}
-
-	newResource->lock = lock;
-
-	rag_writerSignal();
-	return;
+	free(array->stripes);
+	array->stripes = NULL;
+	array->count = 0;
 }
 
-//adds a new thread to the thread list in the RAG
-void rag_addThread(int tid) {
-	struct thread_t* newThread = rag_createThread();
+//maps a key's hash to a stripe, mixing it so that similar hashes spread out
+unsigned int lock_stripe(const SmartLockArray* array, unsigned long hash) {
+	unsigned long long mixed = (unsigned long long)hash * 0x9E3779B97F4A7C15ULL;
+	return (unsigned int)(mixed >> 32) % array->count;
+}
 
-	rag_writerWait();
+/*
+ * Locks several stripes of an array in ascending order, which cannot close
+ * a cycle among the stripes themselves; each request is still checked
+ * against the other locks in the RAG. 'stripes' is sorted in place and its
+ * duplicates removed, updating 'count', so the same list can be passed to
+ * unlock_stripes(). If a stripe is rejected, the ones already taken are
+ * released and LOCK_REJECTED is returned.
+ */
+int lock_stripes(SmartLockArray* array, unsigned int* stripes, int* count) {
 
-	if (threads != NULL) {
-		struct thread_t* curr = threads;
-		while (curr->next != NULL) {
-			curr = curr->next;
+	//insertion sort suits the handful of stripes one operation touches
+	for (int i = 1; i < *count; i++) {
+		unsigned int stripe = stripes[i];
+		int j = i;
+		for (; j > 0 && stripes[j - 1] > stripe; j--) {
+			stripes[j] = stripes[j - 1];
 		}
-		curr->next = newThread;
-	} else {
-		threads = newThread;
+		stripes[j] = stripe;
 	}
 
-	newThread->tid = tid;
-
-	rag_writerSignal();
-	return;
-}
+	int distinct = 0;
+	for (int i = 0; i < *count; i++) {
+		if (distinct == 0 || stripes[distinct - 1] != stripes[i]) {
+			stripes[distinct++] = stripes[i];
+		}
+	}
+	*count = distinct;
 
-//retrieves a resource from the resource list in the RAG
-resource_t* rag_getResource(SmartLock* lock) {
-	struct resource_t* curr = resources;
-	while (curr != NULL) {
-		if (curr->lock == lock) {
-			return curr;
+	for (int i = 0; i < distinct; i++) {
+		if (!lock(&array->stripes[stripes[i]])) {
+			while (i-- > 0) {
+				unlock(&array->stripes[stripes[i]]);
+			}
+			return LOCK_REJECTED;
 		}
-		curr = curr->next;
 	}
-	return curr;
+	return LOCK_ACQUIRED;
 }
 
-//retrieves a thread from the thread list in the RAG
-thread_t* rag_getThread(int tid) {
-	struct thread_t* curr = threads;
-	while (curr != NULL) {
-		if (curr->tid == tid) {
-			return curr;
-		}
-		curr = curr->next;
+//unlocks the stripes taken by lock_stripes(), in reverse order
+void unlock_stripes(SmartLockArray* array, const unsigned int* stripes, int count) {
+	for (int i = count - 1; i >= 0; i--) {
+		unlock(&array->stripes[stripes[i]]);
 	}
-	return curr;
 }
 
-//returns 1 if the lock has been assigned to a thread; else, 0
-_Bool rag_isAssigned(SmartLock* lock) {
+//initializes a SmartIntentLock; it joins the RAG on its first request
+void init_intent_lock(SmartIntentLock* lock) {
+	init_lock(&lock->lock);
+}
 
-	_Bool assignmentExists = false;
+//removes an unused SmartIntentLock from the RAG
+void destroy_intent_lock(SmartIntentLock* lock) {
+	destroy_lock(&lock->lock);
+}
 
-	rag_readerWait();
+/*
+ * Acquires a SmartIntentLock in 'mode', waiting while other threads hold it
+ * in a conflicting mode. A thread that already holds the lock moves up to
+ * the mode covering both holds. The request waits for every holder it
+ * conflicts with, so it is rejected, returning 0, if any of them leads back
+ * to the requester through the RAG.
+ */
+int lock_mode(SmartIntentLock* lock, int mode) {
+	hold_t wanted;
+	wanted.mode = mode;
+	return lock_waitHold(&lock->lock, RESOURCE_INTENT, &wanted);
+}
 
-	resource_t* resourceToCheck = rag_getResource(lock);
-	assignmentExists = resourceToCheck->assignment != NULL;
+//attempts lock_mode() without waiting; returns LOCK_BUSY if a conflicting hold exists
+int trylock_mode(SmartIntentLock* lock, int mode) {
+	hold_t wanted;
+	wanted.mode = mode;
+	return lock_tryHold(&lock->lock, RESOURCE_INTENT, &wanted);
+}
 
-	rag_readerSignal();
+//releases the calling thread's hold of a SmartIntentLock, whatever mode it reached
+void unlock_mode(SmartIntentLock* lock) {
+	record_event(&lock->lock, get_actor(), RECORD_RELEASE);
+	rag_wakeAll(rag_releaseHold(get_actor(), &lock->lock, NULL));
+}
 
-	return assignmentExists;
+//initializes a SmartRangeLock; it joins the RAG on its first request
+void init_range_lock(SmartRangeLock* lock) {
+	init_lock(&lock->lock);
 }
 
-//sets a request edge from 'tid' to 'lock'
-void rag_setRequest(int tid, SmartLock* lock) {
+//removes an unused SmartRangeLock from the RAG
+void destroy_range_lock(SmartRangeLock* lock) {
+	destroy_lock(&lock->lock);
+}
 
-	rag_readerWait();
+/*
+ * Acquires the 'length' bytes from 'start' of a SmartRangeLock, waiting
+ * while any of them are held, by the caller as well. Ranges that do not
+ * overlap are held at once by different threads. The request waits for the
+ * holder of each range it overlaps, so it is rejected, returning 0, if any
+ * of them leads back to the requester through the RAG. An empty range is
+ * rejected as well, and one running past the largest offset ends there.
+ */
+int lock_range(SmartRangeLock* lock, unsigned long long start, unsigned long long length) {
+	hold_t wanted;
+	if (!lock_setRange(&wanted, start, length)) {
+		return LOCK_REJECTED;
+	}
+	return lock_waitHold(&lock->lock, RESOURCE_RANGE, &wanted);
+}
 
-	thread_t* threadToSet = rag_getThread(tid);
-	resource_t* resourceToSet = rag_getResource(lock);
+//attempts lock_range() without waiting; returns LOCK_BUSY if an overlapping range is held
+int trylock_range(SmartRangeLock* lock, unsigned long long start, unsigned long long length) {
+	hold_t wanted;
+	if (!lock_setRange(&wanted, start, length)) {
+		return LOCK_REJECTED;
+	}
+	return lock_tryHold(&lock->lock, RESOURCE_RANGE, &wanted);
+}
 
-	rag_readerSignal();
-	rag_writerWait();
+//releases a range the calling thread acquired with the same 'start' and 'length'
+void unlock_range(SmartRangeLock* lock, unsigned long long start, unsigned long long length) {
 
-	threadToSet->request = resourceToSet;
+	hold_t released;
+	if (!lock_setRange(&released, start, length)) {
+		return;
+	}
 
-	rag_writerSignal();
-	return;
+	record_event(&lock->lock, get_actor(), RECORD_RELEASE);
+	rag_wakeAll(rag_releaseHold(get_actor(), &lock->lock, &released));
 }
 
-//sets an assignment edge from 'lock' to 'edge'
-void rag_setAssignment(int tid, SmartLock* lock) {
-
-	rag_readerWait();
+//sets 'range' to the 'length' bytes from 'start', ending at the largest offset if
+//they would run past it; returns 0 for an empty range
+_Bool lock_setRange(hold_t* range, unsigned long long start, unsigned long long length) {
+	if (length == 0) {
+		return false;
+	}
+	range->start = start;
+	range->end = start + length < start ? ULLONG_MAX : start + length;
+	return true;
+}
 
-	resource_t* resourceToSet = rag_getResource(lock);
-	thread_t* threadToSet = rag_getThread(tid);
+//attempts a lock on a SmartLock without waiting; returns LOCK_BUSY if it is held
+int trylock(SmartLock* lock) {
+	return lock_as(lock, get_actor(), NULL);
+}
 
-	rag_readerSignal();
+//makes the calling thread request locks as 'actor'; 0 restores the thread's own identity
+void set_actor(unsigned long actor) {
+	currentActor = actor;
+}
+
+//returns the actor the calling thread requests locks as
+unsigned long get_actor() {
+	if (!threadKeySet) {
+		rag_setup();
+		threadKeySet = true;
+		pthread_setspecific(threadKey, &threadKey);
+	}
+	if (currentActor != 0) {
+		return currentActor;
+	}
+	return pthread_self();
+}
+
+/*
+ * Chooses whose request is aborted when a request would close a cycle:
+ *		VICTIM_REQUESTER:       the requester is rejected, as by default
+ *		VICTIM_YOUNGEST:        the thread that most recently began holding locks
+ *		VICTIM_FEWEST_HELD:     the thread holding the fewest locks
+ *		VICTIM_LOWEST_PRIORITY: the thread with the lowest set_priority()
+ * Another thread is only chosen if it is waiting in a lock's queue; its
+ * pending request then fails as if rejected, and the requester proceeds.
+ */
+void set_victim_policy(int policy) {
+	rag_setup();
 	rag_writerWait();
+	victimPolicy = policy;
+	rag_writerSignal();
+}
 
-	resourceToSet->assignment = threadToSet;
+//sets the victim selection priority of the calling actor
+void set_priority(int priority) {
+
+	unsigned long tid = get_actor();
+	rag_setup();
+	if (rag_isNewThread(tid)) {
+		rag_addThread(tid);
+	}
 
+	rag_writerWait();
+	rag_getThread(tid)->priority = priority;
 	rag_writerSignal();
-	return;
 }
 
-//removes any request edge associated with 'tid'
-void rag_removeRequest(int tid) {
+/*
+ * Samples 1 in every 'rate' contended lock requests of each thread,
+ * recording the caller's stack and how long it waited; 0 stops sampling.
+ */
+void set_profile_rate(unsigned int rate) {
+	profileRate = rate;
+}
 
-	rag_readerWait();
+/*
+ * Writes the contention profile to 'out' in folded-stack format, one line
+ * per lock and stack: the frames from outermost to innermost, then the
+ * lock, separated by ';', followed by the total nanoseconds waited.
+ */
+void dump_profile(FILE* out) {
 
-	thread_t* threadToRemove = rag_getThread(tid);
+	rag_setup();
+	sem_wait(&profile_mutex);
 
-	rag_readerSignal();
-	rag_writerWait();
+	for (int i = 0; i < PROFILE_SLOTS; i++) {
+		profile_t* entry = &profile[i];
+		if (entry->lock == NULL) {
+			continue;
+		}
 
-	threadToRemove->request = NULL;
+		//skip the innermost frame, which is lock_wait() itself
+		char** symbols = backtrace_symbols(entry->frames, entry->depth);
+		for (int j = entry->depth - 1; j > 0; j--) {
+			profile_printFrame(out, symbols[j]);
+			fprintf(out, ";");
+		}
+		fprintf(out, "lock_%p %llu\n", (void*)entry->lock, entry->waitNs);
+		free(symbols);
+	}
 
-	rag_writerSignal();
-	return;
+	sem_post(&profile_mutex);
 }
 
-//removes any assignment edge associated with 'lock'
-void rag_removeAssignment(SmartLock* lock) {
+/*
+ * Writes the lock statistics of all threads to 'buffer' in the Prometheus
+ * text exposition format, truncated to 'size' bytes including the final
+ * NUL. Each thread's counters are read as they stand, without stopping lock
+ * traffic. Returns the length of the full text, as snprintf() does, so a
+ * larger buffer can be tried if it did not fit.
+ */
+int render_metrics(char* buffer, size_t size) {
+
+	rag_setup();
 
-	rag_readerWait();
+	//the semaphore keeps exiting threads from folding in and freeing their statistics meanwhile
+	while (sem_wait(&stats_mutex) != 0);
+	unsigned long long acquisitions = statsRetired.acquisitions, contentions = statsRetired.contentions;
+	unsigned long long rejections = statsRetired.rejections, cycleChecks = statsRetired.cycleChecks;
+	unsigned long long cycleCheckNs = statsRetired.cycleCheckNs, repeated = statsRetired.repeated;
+	for (stats_t* curr = statsList; curr != NULL; curr = curr->next) {
+		acquisitions += __atomic_load_n(&curr->acquisitions, __ATOMIC_RELAXED);
+		contentions += __atomic_load_n(&curr->contentions, __ATOMIC_RELAXED);
+		rejections += __atomic_load_n(&curr->rejections, __ATOMIC_RELAXED);
+		cycleChecks += __atomic_load_n(&curr->cycleChecks, __ATOMIC_RELAXED);
+		cycleCheckNs += __atomic_load_n(&curr->cycleCheckNs, __ATOMIC_RELAXED);
+		repeated += __atomic_load_n(&curr->repeated, __ATOMIC_RELAXED);
+	}
+	sem_post(&stats_mutex);
 
-	resource_t* resourceToRemove = rag_getResource(lock);
+	return snprintf(buffer, size,
+		"# HELP smartlock_acquisitions_total Locks granted.\n"
+		"# TYPE smartlock_acquisitions_total counter\n"
+		"smartlock_acquisitions_total %llu\n"
+		"# HELP smartlock_contentions_total Lock requests that found the lock held.\n"
+		"# TYPE smartlock_contentions_total counter\n"
+		"smartlock_contentions_total %llu\n"
+		"# HELP smartlock_rejections_total Lock requests rejected or aborted to prevent a deadlock.\n"
+		"# TYPE smartlock_rejections_total counter\n"
+		"smartlock_rejections_total %llu\n"
+		"# HELP smartlock_cycle_checks_total Cycle checks made for lock requests.\n"
+		"# TYPE smartlock_cycle_checks_total counter\n"
+		"smartlock_cycle_checks_total %llu\n"
+		"# HELP smartlock_cycle_check_seconds_total Time spent in cycle checks.\n"
+		"# TYPE smartlock_cycle_check_seconds_total counter\n"
+		"smartlock_cycle_check_seconds_total %.9f\n"
+		"# HELP smartlock_repeated_rejections_total Rejections repeated without a cycle check on an unchanged graph.\n"
+		"# TYPE smartlock_repeated_rejections_total counter\n"
+		"smartlock_repeated_rejections_total %llu\n"
+		"# HELP smartlock_rag_threads Thread nodes in the resource allocation graph.\n"
+		"# TYPE smartlock_rag_threads gauge\n"
+		"smartlock_rag_threads %d\n"
+		"# HELP smartlock_rag_resources Resource nodes in the resource allocation graph.\n"
+		"# TYPE smartlock_rag_resources gauge\n"
+		"smartlock_rag_resources %d\n",
+		acquisitions, contentions, rejections, cycleChecks, cycleCheckNs / 1e9, repeated,
+		__atomic_load_n(&threadCount, __ATOMIC_RELAXED),
+		__atomic_load_n(&resourceCount, __ATOMIC_RELAXED));
+}
 
-	rag_readerSignal();
-	rag_writerWait();
+/*
+ * Records every lock request, grant, rejection, abandoned request and release.
+ * Each thread encodes its events into its own ring buffer, which a writer
+ * thread empties every RECORD_FLUSH_MS into a memory-mapped file named
+ * 'prefix' followed by '.' and the thread's index. Events that find the ring
+ * full are dropped and counted rather than wait for the writer. Returns 0 if
+ * already recording.
+ */
+int start_recording(const char* prefix) {
 
-	resourceToRemove->assignment = NULL;
+	rag_setup();
+	sem_wait(&record_mutex);
 
-	rag_writerSignal();
-	return;
+	if (recording) {
+		sem_post(&record_mutex);
+		return 0;
+	}
+
+	free(recordPrefix);
+	recordPrefix = malloc(strlen(prefix) + 1);
+	strcpy(recordPrefix, prefix);
+	recordFiles = 0;
+	recordGeneration++;
+	sem_init(&recordStop, 0, 0);
+	pthread_create(&recordWriter, NULL, record_writer, NULL);
+	__atomic_store_n(&recording, true, __ATOMIC_SEQ_CST);
+
+	sem_post(&record_mutex);
+	return 1;
 }
 
-//performs semaphore waiting for a read operation
-void rag_readerWait() {
+//stops recording, writing out what the rings hold and trimming each file
+void stop_recording() {
 
-	sem_wait(&assign_mutex);
-	assign_readers++;
-	if (assign_readers == 1) {
-		sem_wait(&assign_mutexRw);
+	//a program that never recorded may not have set up the semaphores at all
+	if (!__atomic_load_n(&recording, __ATOMIC_ACQUIRE)) {
+		return;
 	}
-	sem_post(&assign_mutex);
-	return;
+
+	sem_wait(&record_mutex);
+	if (!recording) {
+		sem_post(&record_mutex);
+		return;
+	}
+	__atomic_store_n(&recording, false, __ATOMIC_SEQ_CST);
+	sem_post(&record_mutex);
+
+	sem_post(&recordStop);
+	pthread_join(recordWriter, NULL);
+	sem_destroy(&recordStop);
+
+	sem_wait(&record_mutex);
+	for (recorder_t* curr = __atomic_load_n(&recorders, __ATOMIC_ACQUIRE); curr != NULL; curr = curr->next) {
+		if (curr->generation == recordGeneration) {
+			record_close(curr);
+		}
+	}
+	record_sweep();
+	sem_post(&record_mutex);
 }
 
-//performs semaphore signaling for a read operation
-void rag_readerSignal() {
+/*
+ * Opens a file written by start_recording() for read_record(). Returns 0 if
+ * it cannot be opened or is not a recording.
+ */
+int open_recording(record_reader_t* reader, const char* path) {
 
-	sem_wait(&assign_mutex);
-	assign_readers--;
-	if (assign_readers == 0) {
-		sem_post(&assign_mutexRw);
+	reader->file = fopen(path, "rb");
+	if (reader->file == NULL) {
+		return false;
 	}
-	sem_post(&assign_mutex);
-	return;
+
+	record_header_t header;
+	if (fread(&header, sizeof(header), 1, reader->file) != 1
+		|| memcmp(header.magic, "SLOG", 4) != 0 || header.version != RECORD_VERSION) {
+		fclose(reader->file);
+		reader->file = NULL;
+		return false;
+	}
+
+	reader->thread = header.thread;
+	reader->tid = header.tid;
+	reader->ns = header.base;
+	reader->dropped = header.dropped;
+	return true;
 }
 
-//performs semaphore waiting for a write operation
-void rag_writerWait() {
-	sem_wait(&assign_mutex);
-	return;
+//decodes the next event of a recording into 'record'; returns 0 at its end
+int read_record(record_reader_t* reader, lock_record_t* record) {
+
+	unsigned long long type, delta, lock, tid;
+	if (!record_getVarint(reader->file, &type) || !record_getVarint(reader->file, &delta)
+		|| !record_getVarint(reader->file, &lock)) {
+		return false;
+	}
+	tid = reader->tid;
+	if ((type & RECORD_FOREIGN) && !record_getVarint(reader->file, &tid)) {
+		return false;
+	}
+
+	reader->ns += delta;
+	record->ns = reader->ns;
+	record->lock = lock;
+	record->tid = tid;
+	record->event = type & ~RECORD_FOREIGN;
+	record->thread = reader->thread;
+	return true;
 }
 
-//performs semaphore signaling for a write operation
-void rag_writerSignal() {
-	sem_post(&assign_mutex);
-	return;
+void close_recording(record_reader_t* reader) {
+	if (reader->file != NULL) {
+		fclose(reader->file);
+		reader->file = NULL;
+	}
 }
 
-//checks if the given thread 'tid' has an associated thread object
-_Bool rag_isNewThread(int tid) {
+/*
+ * Starts a watchdog thread that samples the RAG every 'periodMs' and writes
+ * a line to 'out' for each lock held longer than 'thresholdMs', naming its
+ * holder and the threads waiting for it; each holder of an intent or range
+ * lock is timed on its own. While it runs, locks are taken through the RAG
+ * instead of their fast path, so every hold is seen. Holds that began before
+ * the watchdog started are not timed, and a lock held through its fast path
+ * then is only seen once another thread contends for it. Returns 0 if it is
+ * already running.
+ */
+int start_watchdog(long thresholdMs, long periodMs, FILE* out) {
+
+	if (watchdogRunning) {
+		return 0;
+	}
+
+	watchdogThreshold = thresholdMs;
+	watchdogPeriod = periodMs;
+	watchdogOut = out;
+	sem_init(&watchdogStop, 0, 0);
+	rag_setup();
+
+	rag_writerWait();
+	watchdogRunning = true;
+	rag_writerSignal();
+
+	pthread_create(&watchdogThread, NULL, rag_watchdog, NULL);
+	return 1;
+}
+
+//stops the watchdog thread started by start_watchdog()
+void stop_watchdog() {
+
+	if (!watchdogRunning) {
+		return;
+	}
+
+	rag_writerWait();
+	watchdogRunning = false;
+	rag_writerSignal();
+
+	sem_post(&watchdogStop);
+	pthread_join(watchdogThread, NULL);
+	sem_destroy(&watchdogStop);
+}
+
+/*
+ * Returns the RAG node of a finished actor to the pool so later actors can
+ * reuse it. Returns 0, leaving the node in place, if the actor still holds
+ * or waits for a lock.
+ */
+int release_actor(unsigned long actor) {
+	rag_setup();
+	return rag_removeThread(actor);
+}
+
+/*
+ * Finds the strongly connected components of a wait-for graph with
+ * 'workers' threads, or one per online processor if it is 0. The component
+ * of each node is written to 'components', or -1 for a node on no cycle; a
+ * component of several nodes, or of one waiting for itself, is a group of
+ * deadlocked threads. Returns the number of components, numbered from 0 in
+ * no particular order.
+ */
+int find_cycles(const wait_graph_t* graph, int workers, int* components) {
+
+	if (workers <= 0) {
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (workers <= 0) {
+		workers = 1;
+	}
+
+	int nodes = graph->nodes;
+	int edges = graph->offsets[nodes];
+
+	detect_t run;
+	memset(&run, 0, sizeof(detect_t));
+	run.graph = graph;
+	run.components = components;
+	run.workers = workers;
+	run.pivot = -1;
+	run.inDegree = calloc(nodes + 1, sizeof(int));
+	run.reverseOffsets = malloc((nodes + 1) * sizeof(int));
+	run.reverseTargets = malloc((edges + 1) * sizeof(int));
+	run.marks = calloc(nodes + 1, sizeof(int));
+	run.pivots = malloc(workers * sizeof(int));
+	run.frontier = malloc((nodes + 1) * sizeof(int));
+	run.next = malloc((nodes + 1) * sizeof(int));
+	run.parents = malloc((nodes + 1) * sizeof(int));
+	run.order = malloc((nodes + 1) * sizeof(int));
+	run.partStarts = malloc((nodes + 1) * sizeof(int));
+	run.index = malloc((nodes + 1) * sizeof(int));
+	run.lowlink = malloc((nodes + 1) * sizeof(int));
+	run.cursor = malloc((nodes + 1) * sizeof(int));
+	run.stack = malloc((nodes + 1) * sizeof(int));
+	run.calls = malloc((nodes + 1) * sizeof(int));
+	pthread_barrier_init(&run.barrier, NULL, workers);
+
+	detect_worker_t* team = malloc(workers * sizeof(detect_worker_t));
+	for (int i = 1; i < workers; i++) {
+		team[i].run = &run;
+		team[i].worker = i;
+		pthread_create(&team[i].thread, NULL, detect_worker, &team[i]);
+	}
+	detect_run(&run, 0);
+	for (int i = 1; i < workers; i++) {
+		pthread_join(team[i].thread, NULL);
+	}
+
+	pthread_barrier_destroy(&run.barrier);
+	free(team);
+	free(run.inDegree);
+	free(run.reverseOffsets);
+	free(run.reverseTargets);
+	free(run.marks);
+	free(run.pivots);
+	free(run.frontier);
+	free(run.next);
+	free(run.parents);
+	free(run.order);
+	free(run.partStarts);
+	free(run.index);
+	free(run.lowlink);
+	free(run.cursor);
+	free(run.stack);
+	free(run.calls);
+	return run.count;
+}
 
+/*
+ * Finds every group of deadlocked threads in the RAG, writing each to 'out'
+ * unless it is NULL, with the lock each of its threads waits for and the
+ * threads of the group holding it. The wait-for graph is copied while the
+ * RAG is read and searched by find_cycles() after, so lock requests go on
+ * meanwhile. Deadlocks only form when requests skip the cycle check, as
+ * those of lock_ordered() do. Returns the number of groups.
+ */
+int find_deadlocks(int workers, FILE* out) {
+
+	rag_setup();
 	rag_readerWait();
 
-	struct thread_t* curr = threads;
-	while (curr != NULL) {
-		if (curr->tid == tid) {
-			rag_readerSignal();
-			return false;
+	int count = rag_countThreads();
+	int slots = 2;
+	while (slots < 2 * count) {
+		slots *= 2;
+	}
+	thread_t** table = calloc(slots, sizeof(thread_t*));
+	int* indices = malloc(slots * sizeof(int));
+	unsigned long* tids = malloc((count + 1) * sizeof(unsigned long));
+	SmartLock** requested = malloc((count + 1) * sizeof(SmartLock*));
+	int* offsets = malloc((count + 1) * sizeof(int));
+	int capacity = count + 1;
+	int* targets = malloc(capacity * sizeof(int));
+
+	int node = 0;
+	for (thread_t* thr = threads; thr != NULL; thr = thr->next) {
+		int slot = detect_slot(table, slots, thr);
+		table[slot] = thr;
+		indices[slot] = node;
+		tids[node] = thr->tid;
+		requested[node] = thr->request != NULL ? thr->request->lock : NULL;
+		node++;
+	}
+
+	int edges = 0;
+	node = 0;
+	for (thread_t* thr = threads; thr != NULL; thr = thr->next) {
+		offsets[node++] = edges;
+		search_t search = { thr, NULL, false };
+		thread_t* blocker;
+		while ((blocker = rag_nextBlocker(&search)) != NULL) {
+			if (edges == capacity) {
+				capacity *= 2;
+				targets = realloc(targets, capacity * sizeof(int));
+			}
+			int slot = detect_slot(table, slots, blocker);
+			if (table[slot] != NULL) {
+				targets[edges++] = indices[slot];
+			}
 		}
-		curr = curr->next;
 	}
+	offsets[count] = edges;
 
 	rag_readerSignal();
-	return true;
+
+	wait_graph_t graph = { count, offsets, targets };
+	int* components = malloc((count + 1) * sizeof(int));
+	int groups = find_cycles(&graph, workers, components);
+
+	//lists the threads of each group together
+	int* starts = calloc(groups + 1, sizeof(int));
+	int* members = malloc((count + 1) * sizeof(int));
+	for (int i = 0; i < count; i++) {
+		if (components[i] >= 0) {
+			starts[components[i] + 1]++;
+		}
+	}
+	for (int group = 0; group < groups; group++) {
+		starts[group + 1] += starts[group];
+	}
+	int* filled = malloc((groups + 1) * sizeof(int));
+	memcpy(filled, starts, (groups + 1) * sizeof(int));
+	for (int i = 0; i < count; i++) {
+		if (components[i] >= 0) {
+			members[filled[components[i]]++] = i;
+		}
+	}
+
+	for (int group = 0; group < groups && out != NULL; group++) {
+		int size = starts[group + 1] - starts[group];
+		fprintf(out, "smartlock: deadlock of %d thread%s:\n", size, size == 1 ? "" : "s");
+		for (int i = starts[group]; i < starts[group + 1]; i++) {
+			int waiter = members[i];
+			fprintf(out, "smartlock:   thread %lu waits for lock %p held by", tids[waiter], (void*)requested[waiter]);
+			for (int edge = offsets[waiter]; edge < offsets[waiter + 1]; edge++) {
+				if (components[targets[edge]] == group) {
+					fprintf(out, " %lu", tids[targets[edge]]);
+				}
+			}
+			fprintf(out, "\n");
+		}
+	}
+	if (out != NULL) {
+		fflush(out);
+	}
+
+	free(table);
+	free(indices);
+	free(tids);
+	free(requested);
+	free(offsets);
+	free(targets);
+	free(components);
+	free(starts);
+	free(members);
+	free(filled);
+	return groups;
+}
+
+/*
+ * Requests a SmartLock on behalf of the RAG node 'tid' without blocking.
+ * If the lock is held, 'waiter' is queued with the request edge left in
+ * place, and its wake function is called once the lock is released so the
+ * request can be retried; with no waiter, LOCK_BUSY is returned instead.
+ */
+int lock_as(SmartLock* lock, unsigned long tid, waiter_t* waiter) {
+	record_event(lock, tid, RECORD_REQUEST);
+	int result = lock_request(lock, tid, waiter, CHECK_REJECT, NULL, NULL);
+	if (result == LOCK_BUSY || result == LOCK_PARKED) {
+		stats_add(&stats_get()->contentions, 1);
+	}
+	return result;
 }
 
-//checks the graph for any cycles to prevent deadlocks
-_Bool rag_checkForCycles(int tid) {
+//waits on a private semaphore until the request of 'tid' for 'lock' is settled
+int lock_wait(SmartLock* lock, unsigned long tid, int check, const struct timespec* abstime,
+	cycle_step_t* cycle, int* length) {
 
-	rag_readerWait();
+	blocked_t blocked;
+	blocked.waiter.wake = rag_wakeThread;
+	blocked.waiter.wakeups = NULL;
+	sem_init(&blocked.wakeup, 0, 0);
+	record_event(lock, tid, RECORD_REQUEST);
 
-	thread_t* threadToSearch = rag_getThread(tid);
-	_Bool isCycle = rag_depthFirstSearch(threadToSearch);
+	//retry the request each time it may succeed, unless the lock was handed over
+	int result = lock_request(lock, tid, &blocked.waiter, check, cycle, length);
 
-	for (resource_t* curr = resources; curr != NULL; curr = curr->next) {
-		curr->travelled = false;
+	if (result == LOCK_PARKED) {
+		stats_add(&stats_get()->contentions, 1);
 	}
-	for (thread_t* curr = threads; curr != NULL; curr = curr->next) {
-		curr->travelled = false;
+
+	//capture the caller's stack for a sampled contended request
+	void* frames[PROFILE_DEPTH];
+	int depth = 0;
+	struct timespec start;
+	if (result == LOCK_PARKED && profile_shouldSample()) {
+		depth = backtrace(frames, PROFILE_DEPTH);
+		clock_gettime(CLOCK_MONOTONIC, &start);
 	}
 
-	rag_readerSignal();
-	return isCycle;
+	while (result == LOCK_PARKED) {
+		if (!lock_sleep(&blocked, abstime)) {
+			result = lock_abandon(lock, tid, &blocked);
+		} else if (blocked.waiter.granted) {
+			result = LOCK_ACQUIRED;
+		} else if (blocked.waiter.aborted) {
+			result = LOCK_REJECTED;
+		} else {
+			result = lock_request(lock, tid, &blocked.waiter, check, cycle, length);
+		}
+	}
+
+	if (depth > 0) {
+		profile_record(lock, frames, depth, &start);
+	}
+
+	sem_destroy(&blocked.wakeup);
+	return result;
 }
 
-//performs DFS traversal recursively on the RAG, returning 1 if a cycle is found; else 0.
-_Bool rag_depthFirstSearch(thread_t* currentNode) {
+//requests 'lock' for 'tid', treating a request that would create a cycle as 'check' says;
+//a rejected request's cycle is written to 'cycle' if it is given
+int lock_request(SmartLock* lock, unsigned long tid, waiter_t* waiter, int check,
+	cycle_step_t* cycle, int* length) {
 
-	if (currentNode == NULL) {
-		return false;
+	//a lock that was never contended is taken without the RAG
+	if (lock_tryFast(lock, tid)) {
+		stats_add(&stats_get()->acquisitions, 1);
+		record_event(lock, tid, RECORD_GRANT);
+		return LOCK_ACQUIRED;
+	}
+	_Bool isRepeated = check == CHECK_REJECT && cycle == NULL && lock_isRejected(lock, tid, NULL);
+	if (!isRepeated) {
+		rag_register(lock);
+
+		//if the thread is new, add it to the threads list
+		if (rag_isNewThread(tid)) {
+			rag_addThread(tid);
+		}
+
+		//since the lock isn't already given, set a request edge
+		rag_setRequest(tid, lock);
+
+		//if a cycle is detected, either wait for it to be broken or reject the thread
+		if (check == CHECK_WAIT && rag_parkUnsafe(tid, waiter)) {
+			return LOCK_PARKED;
+		}
 	}
-	if (currentNode->travelled == true) {
-		return true;
+	if (isRepeated || (check == CHECK_REJECT && rag_checkForCycles(tid, cycle, length) && !rag_abortVictim(tid))) {
+		if (isRepeated) {
+			stats_add(&stats_get()->repeated, 1);
+		} else {
+			unsigned long long checked = checkedVersion;
+			rag_removeRequest(tid);
+			lock_rememberRejection(lock, tid, NULL, checked);
+		}
+		stats_add(&stats_get()->rejections, 1);
+		record_event(lock, tid, RECORD_REJECT);
+
+		//a woken waiter may be turned away; let the next one try instead
+		lock_wakeNext(lock);
+		return LOCK_REJECTED;
 	}
-	currentNode->travelled = true;
 
-	resource_t* tempResource = currentNode->request;
-	if (tempResource == NULL) {
-		return false;
+	//if the lock creates no cycles and is free, give it to the thread
+	if (!rag_tryAssignment(tid, lock, waiter)) {
+		if (waiter == NULL) {
+			rag_removeRequest(tid);
+			record_event(lock, tid, RECORD_ABANDON);
+			return LOCK_BUSY;
+		}
+		return LOCK_PARKED;
+	}
+	stats_add(&stats_get()->acquisitions, 1);
+	record_event(lock, tid, RECORD_GRANT);
+
+	//remove the request edge now that assignment is created
+	rag_removeRequest(tid);
+	return LOCK_ACQUIRED;
+}
+
+//waits on a private semaphore until the request for the hold 'wanted' of 'lock' is settled
+int lock_waitHold(SmartLock* lock, int kind, hold_t* wanted) {
+
+	unsigned long tid = get_actor();
+
+	blocked_t blocked;
+	blocked.waiter.wake = rag_wakeThread;
+	blocked.waiter.wakeups = NULL;
+	sem_init(&blocked.wakeup, 0, 0);
+	record_event(lock, tid, RECORD_REQUEST);
+
+	//the holds in the way may have gone; retry on every wakeup
+	int result = lock_requestHold(lock, tid, kind, wanted, &blocked.waiter);
+
+	if (result == LOCK_PARKED) {
+		stats_add(&stats_get()->contentions, 1);
+	}
+
+	while (result == LOCK_PARKED) {
+		lock_sleep(&blocked, NULL);
+		if (blocked.waiter.aborted) {
+			result = LOCK_REJECTED;
+		} else {
+			result = lock_requestHold(lock, tid, kind, wanted, &blocked.waiter);
+		}
+	}
+
+	sem_destroy(&blocked.wakeup);
+	return result;
+}
+
+//requests the hold 'wanted' of 'lock' without waiting
+int lock_tryHold(SmartLock* lock, int kind, hold_t* wanted) {
+	record_event(lock, get_actor(), RECORD_REQUEST);
+	int result = lock_requestHold(lock, get_actor(), kind, wanted, NULL);
+	if (result == LOCK_BUSY) {
+		stats_add(&stats_get()->contentions, 1);
+	}
+	return result;
+}
+
+//requests the hold 'wanted' of 'lock' for 'tid'; only a request that a hold is in the
+//way of sets a request edge and is checked for cycles
+int lock_requestHold(SmartLock* lock, unsigned long tid, int kind, hold_t* wanted, waiter_t* waiter) {
+
+	if (waiter != NULL && lock_isRejected(lock, tid, wanted)) {
+		stats_add(&stats_get()->repeated, 1);
+		stats_add(&stats_get()->rejections, 1);
+		record_event(lock, tid, RECORD_REJECT);
+		return LOCK_REJECTED;
+	}
+
+	rag_register(lock);
+	if (rag_isNewThread(tid)) {
+		rag_addThread(tid);
+	}
+
+	if (!rag_tryHold(tid, lock, kind, wanted, NULL)) {
+		if (waiter == NULL) {
+			record_event(lock, tid, RECORD_ABANDON);
+			return LOCK_BUSY;
+		}
+
+		rag_setHoldRequest(tid, lock, wanted);
+		if (rag_checkForCycles(tid, NULL, NULL) && !rag_abortVictim(tid)) {
+			unsigned long long checked = checkedVersion;
+			rag_removeRequest(tid);
+			lock_rememberRejection(lock, tid, wanted, checked);
+			stats_add(&stats_get()->rejections, 1);
+			record_event(lock, tid, RECORD_REJECT);
+			return LOCK_REJECTED;
+		}
+
+		//a release between the two attempts is seen by the second
+		if (!rag_tryHold(tid, lock, kind, wanted, waiter)) {
+			return LOCK_PARKED;
+		}
+	}
+
+	stats_add(&stats_get()->acquisitions, 1);
+	record_event(lock, tid, RECORD_GRANT);
+	return LOCK_ACQUIRED;
+}
+
+//sleeps until woken or until 'abstime' passes, returning 0 on timeout
+_Bool lock_sleep(blocked_t* blocked, const struct timespec* abstime) {
+
+	int status;
+	do {
+		if (abstime != NULL) {
+			status = sem_timedwait(&blocked->wakeup, abstime);
+		} else {
+			status = sem_wait(&blocked->wakeup);
+		}
+	} while (status != 0 && errno == EINTR);
+
+	return status == 0;
+}
+
+//waits a random time of at most 'bound' before the next attempt; returns 0 if the deadline passed
+_Bool lock_backoff(const retry_policy_t* policy, long bound, unsigned int* seed) {
+
+	//unsigned, as a bound of more than about 4 s overflows a signed product
+	long delay = (long)((unsigned long long)bound * rand_r(seed) / ((unsigned long long)RAND_MAX + 1));
+
+	if (policy->deadline.tv_sec != 0 || policy->deadline.tv_nsec != 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		long long remaining = (policy->deadline.tv_sec - now.tv_sec) * 1000000000LL
+			+ (policy->deadline.tv_nsec - now.tv_nsec);
+		if (remaining <= 0) {
+			return false;
+		}
+		if (remaining < delay) {
+			delay = remaining;
+		}
+	}
+
+	if (policy->flags & RETRY_YIELD) {
+		//yields the processor to other threads until the delay has passed
+		struct timespec start, now;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			sched_yield();
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		} while ((now.tv_sec - start.tv_sec) * 1000000000LL + (now.tv_nsec - start.tv_nsec) < delay);
+	} else {
+		struct timespec pause = { delay / 1000000000L, delay % 1000000000L };
+		while (nanosleep(&pause, &pause) != 0 && errno == EINTR);
+	}
+	return true;
+}
+
+/*
+ * Withdraws a waiting request whose deadline has passed. If a release has
+ * already dequeued the waiter, its wakeup is taken first; the lock is then
+ * kept if it was handed over, and otherwise passed on to the next waiter.
+ */
+int lock_abandon(SmartLock* lock, unsigned long tid, blocked_t* blocked) {
+
+	if (!rag_cancelWaiter(lock, &blocked->waiter)) {
+		while (sem_wait(&blocked->wakeup) != 0);
+		if (blocked->waiter.granted) {
+			return LOCK_ACQUIRED;
+		}
 	}
-	if (tempResource->travelled == true) {
-		return true;
+
+	rag_removeRequest(tid);
+	record_event(lock, tid, RECORD_ABANDON);
+	lock_wakeNext(lock);
+	return LOCK_REJECTED;
+}
+
+//encodes an event of 'tid' on 'lock' into the calling thread's ring while recording
+void record_event(SmartLock* lock, unsigned long tid, int event) {
+
+	if (!__atomic_load_n(&recording, __ATOMIC_ACQUIRE)) {
+		return;
 	}
-	tempResource->travelled = true;
 
-	thread_t* nextThread = tempResource->assignment;
-	return rag_depthFirstSearch(nextThread);
-}
\ No newline at end of file
+	recorder_t* recorder = record_getRecorder();
+	if (recorder == NULL) {
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	unsigned long long ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	unsigned char encoded[RECORD_MAX];
+	_Bool foreign = tid != recorder->header.tid;
+	int length = record_putVarint(encoded, event | (foreign ? RECORD_FOREIGN : 0));
+	length += record_putVarint(encoded + length, ns - recorder->last);
+	length += record_putVarint(encoded + length, lock_getId(lock));
+	if (foreign) {
+		length += record_putVarint(encoded + length, tid);
+	}
+
+	size_t head = recorder->head;
+	size_t tail = __atomic_load_n(&recorder->tail, __ATOMIC_ACQUIRE);
+	if (RECORD_RING - (head - tail) < length) {
+		__atomic_add_fetch(&recorder->header.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (int i = 0; i < length; i++) {
+		recorder->ring[(head + i) % RECORD_RING] = encoded[i];
+	}
+	recorder->last = ns;
+	__atomic_store_n(&recorder->head, head + length, __ATOMIC_RELEASE);
+}
+
+//returns the calling thread's stream for the current recording, starting it on first use
+recorder_t* record_getRecorder() {
+
+	recorder_t* recorder = currentRecorder;
+	if (recorder != NULL && recorder->generation == recordGeneration) {
+		return recorder;
+	}
+
+	//the writer holds record_mutex across file I/O, so the stream is started without it
+	if (!__atomic_load_n(&recording, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	//the writer frees the stream of the last recording once it sees it retired
+	if (recorder != NULL) {
+		__atomic_store_n(&recorder->retired, true, __ATOMIC_RELEASE);
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	recorder = malloc(sizeof(recorder_t));
+	memcpy(recorder->header.magic, "SLOG", 4);
+	recorder->header.version = RECORD_VERSION;
+	recorder->header.thread = __atomic_fetch_add(&recordFiles, 1, __ATOMIC_RELAXED);
+	recorder->header.reserved = 0;
+	recorder->header.tid = get_actor();
+	recorder->header.base = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	recorder->header.dropped = 0;
+	recorder->head = 0;
+	recorder->tail = 0;
+	recorder->last = recorder->header.base;
+	recorder->generation = __atomic_load_n(&recordGeneration, __ATOMIC_ACQUIRE);
+	recorder->fd = -1;
+	recorder->failed = false;
+	recorder->file = NULL;
+	recorder->used = 0;
+	recorder->capacity = 0;
+	recorder->retired = false;
+	recorder->next = __atomic_load_n(&recorders, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&recorders, &recorder->next, recorder, false,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	//the key's destructor writes out and frees the stream when the thread exits
+	pthread_setspecific(recordKey, recorder);
+	currentRecorder = recorder;
+	return recorder;
+}
+
+//writes out the stream of an exiting thread, closes its file and frees it
+void record_retire(void* arg) {
+
+	recorder_t* recorder = arg;
+
+	//a stream of an earlier recording was closed when it stopped, or never opened
+	sem_wait(&record_mutex);
+	if (recorder->generation == recordGeneration) {
+		record_drain(recorder);
+	}
+	record_close(recorder);
+	record_unlink(recorder);
+	sem_post(&record_mutex);
+
+	//an event from a later destructor starts a new stream
+	currentRecorder = NULL;
+	free(recorder);
+}
+
+//frees the streams their threads have retired; the caller holds record_mutex
+void record_sweep() {
+	recorder_t* curr = __atomic_load_n(&recorders, __ATOMIC_ACQUIRE);
+	while (curr != NULL) {
+		recorder_t* next = curr->next;
+		if (__atomic_load_n(&curr->retired, __ATOMIC_ACQUIRE)) {
+			//a stream is retired only after its recording stopped, which closed its file
+			record_close(curr);
+			record_unlink(curr);
+			free(curr);
+		}
+		curr = next;
+	}
+}
+
+//removes a stream from the list under record_mutex while threads may push new ones at its head
+void record_unlink(recorder_t* recorder) {
+
+	recorder_t* prev = recorder;
+	if (__atomic_compare_exchange_n(&recorders, &prev, recorder->next, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	//streams were pushed ahead of it, and only the holder of record_mutex changes their links
+	while (prev->next != recorder) {
+		prev = prev->next;
+	}
+	prev->next = recorder->next;
+}
+
+//writes 'value' as a little-endian base-128 varint, returning its length
+int record_putVarint(unsigned char* out, unsigned long long value) {
+	int length = 0;
+	while (value >= 0x80) {
+		out[length++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	out[length++] = value;
+	return length;
+}
+
+_Bool record_getVarint(FILE* in, unsigned long long* value) {
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int byte = getc(in);
+		if (byte == EOF) {
+			return false;
+		}
+		*value |= (unsigned long long)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//empties the rings every RECORD_FLUSH_MS until stopped, then once more
+void* record_writer(void* arg) {
+
+	struct timespec wake;
+	do {
+		record_flush();
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_nsec += RECORD_FLUSH_MS * 1000000L;
+		if (wake.tv_nsec >= 1000000000L) {
+			wake.tv_sec++;
+			wake.tv_nsec -= 1000000000L;
+		}
+	} while (sem_timedwait(&recordStop, &wake) != 0);
+
+	record_flush();
+	return NULL;
+}
+
+void record_flush() {
+	sem_wait(&record_mutex);
+	for (recorder_t* curr = __atomic_load_n(&recorders, __ATOMIC_ACQUIRE); curr != NULL; curr = curr->next) {
+		if (curr->generation == recordGeneration) {
+			record_drain(curr);
+		}
+	}
+	record_sweep();
+	sem_post(&record_mutex);
+}
+
+//moves the encoded events of a stream's ring to its file, opening it on first use
+void record_drain(recorder_t* recorder) {
+
+	if (recorder->failed) {
+		return;
+	}
+
+	if (recorder->fd < 0) {
+		char path[4096];
+		snprintf(path, sizeof(path), "%s.%u", recordPrefix, recorder->header.thread);
+		recorder->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (recorder->fd < 0 || !record_grow(recorder, sizeof(record_header_t))) {
+			perror("smartlock: recording");
+			recorder->failed = true;
+			return;
+		}
+		recorder->used = sizeof(record_header_t);
+	}
+
+	size_t tail = recorder->tail;
+	size_t head = __atomic_load_n(&recorder->head, __ATOMIC_ACQUIRE);
+	if (recorder->used + (head - tail) > recorder->capacity
+		&& !record_grow(recorder, recorder->used + (head - tail))) {
+		perror("smartlock: recording");
+		recorder->failed = true;
+		return;
+	}
+
+	for (size_t i = tail; i != head; i++) {
+		recorder->file[recorder->used++] = recorder->ring[i % RECORD_RING];
+	}
+	__atomic_store_n(&recorder->tail, head, __ATOMIC_RELEASE);
+}
+
+//extends a stream's file by whole chunks to hold 'needed' bytes and maps it again
+_Bool record_grow(recorder_t* recorder, size_t needed) {
+
+	size_t capacity = recorder->capacity;
+	while (capacity < needed) {
+		capacity += RECORD_CHUNK;
+	}
+	if (ftruncate(recorder->fd, capacity) != 0) {
+		return false;
+	}
+
+	void* file = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, recorder->fd, 0);
+	if (file == MAP_FAILED) {
+		return false;
+	}
+
+	if (recorder->file != NULL) {
+		munmap(recorder->file, recorder->capacity);
+	}
+	recorder->file = file;
+	recorder->capacity = capacity;
+	return true;
+}
+
+//writes the header of a stream's file, then unmaps it and trims it to the bytes written
+void record_close(recorder_t* recorder) {
+
+	if (recorder->fd < 0) {
+		return;
+	}
+
+	if (recorder->file != NULL) {
+		recorder->header.dropped = __atomic_load_n(&recorder->header.dropped, __ATOMIC_RELAXED);
+		memcpy(recorder->file, &recorder->header, sizeof(record_header_t));
+		munmap(recorder->file, recorder->capacity);
+		recorder->file = NULL;
+	}
+	if (ftruncate(recorder->fd, recorder->used) != 0) {
+		perror("smartlock: trimming recording");
+	}
+	close(recorder->fd);
+	recorder->fd = -1;
+	recorder->failed = true;
+}
+
+//returns the calling thread's statistics, adding them to the list on first use
+stats_t* stats_get() {
+
+	stats_t* stats = currentStats;
+	if (stats != NULL) {
+		return stats;
+	}
+
+	rag_setup();
+	stats = calloc(1, sizeof(stats_t));
+	while (sem_wait(&stats_mutex) != 0);
+	stats->next = statsList;
+	statsList = stats;
+	sem_post(&stats_mutex);
+
+	//the key's destructor retires them when the thread exits
+	pthread_setspecific(statsKey, stats);
+	currentStats = stats;
+	return stats;
+}
+
+//folds the statistics of an exiting thread into the retired sums and frees them
+void stats_retire(void* arg) {
+
+	stats_t* stats = arg;
+
+	while (sem_wait(&stats_mutex) != 0);
+	statsRetired.acquisitions += stats->acquisitions;
+	statsRetired.contentions += stats->contentions;
+	statsRetired.rejections += stats->rejections;
+	statsRetired.cycleChecks += stats->cycleChecks;
+	statsRetired.cycleCheckNs += stats->cycleCheckNs;
+	statsRetired.repeated += stats->repeated;
+	stats_t** link = &statsList;
+	while (*link != stats) {
+		link = &(*link)->next;
+	}
+	*link = stats->next;
+	sem_post(&stats_mutex);
+
+	//a lock taken by a later destructor starts new statistics
+	currentStats = NULL;
+	free(stats);
+}
+
+//adds to a counter of the calling thread; render_metrics() may read it meanwhile
+void stats_add(unsigned long long* counter, unsigned long long amount) {
+	__atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+//takes 'lock' for 'tid' without the RAG if it is free and was never registered
+_Bool lock_tryFast(SmartLock* lock, unsigned long tid) {
+
+	//while the watchdog runs, locks are registered so that it sees every hold
+	if (__atomic_load_n(&watchdogRunning, __ATOMIC_RELAXED)) {
+		return false;
+	}
+	unsigned long owner = 0;
+	return __atomic_compare_exchange_n(&lock->owner, &owner, tid, false,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+//frees 'lock' if it is held without the RAG; returns 0 if it is registered instead
+_Bool lock_releaseFast(SmartLock* lock) {
+	unsigned long owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+	while (owner != LOCK_REGISTERED) {
+		if (__atomic_compare_exchange_n(&lock->owner, &owner, 0, false,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//returns the id of 'lock', numbering locks from 1 in the order they are first recorded
+unsigned int lock_getId(SmartLock* lock) {
+	unsigned int id = __atomic_load_n(&lock->id, __ATOMIC_RELAXED);
+	if (id == 0) {
+		unsigned int newId = __atomic_add_fetch(&lockIds, 1, __ATOMIC_RELAXED);
+		if (!__atomic_compare_exchange_n(&lock->id, &id, newId, false,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			return id;
+		}
+		id = newId;
+	}
+	return id;
+}
+
+//returns 1 if the calling thread's current contended request should be sampled
+_Bool profile_shouldSample() {
+	unsigned int rate = profileRate;
+	return rate != 0 && ++profileCount % rate == 0;
+}
+
+//adds a sampled wait on 'lock' that began at 'start' to the profile entry for its stack
+void profile_record(SmartLock* lock, void** frames, int depth, struct timespec* start) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	unsigned long long waitNs = (now.tv_sec - start->tv_sec) * 1000000000ULL
+		+ now.tv_nsec - start->tv_nsec;
+
+	unsigned long hash = (unsigned long)lock;
+	for (int i = 0; i < depth; i++) {
+		hash = hash * 31 + (unsigned long)frames[i];
+	}
+
+	sem_wait(&profile_mutex);
+
+	//probe for the entry of this lock and stack, or claim an empty one; drop the sample if full
+	for (int i = 0; i < PROFILE_SLOTS; i++) {
+		profile_t* entry = &profile[(hash + i) % PROFILE_SLOTS];
+		if (entry->lock == NULL) {
+			entry->lock = lock;
+			entry->depth = depth;
+			memcpy(entry->frames, frames, depth * sizeof(void*));
+		} else if (entry->lock != lock || entry->depth != depth
+			|| memcmp(entry->frames, frames, depth * sizeof(void*)) != 0) {
+			continue;
+		}
+		entry->count++;
+		entry->waitNs += waitNs;
+		break;
+	}
+
+	sem_post(&profile_mutex);
+	return;
+}
+
+//writes the function name of a backtrace_symbols() entry, or its address if it has none
+void profile_printFrame(FILE* out, const char* symbol) {
+
+	const char* name = strchr(symbol, '(');
+	const char* end = name != NULL ? strpbrk(name, "+)") : NULL;
+	if (end != NULL && end > name + 1) {
+		fprintf(out, "%.*s", (int)(end - name - 1), name + 1);
+		return;
+	}
+
+	const char* address = strchr(symbol, '[');
+	end = address != NULL ? strchr(address, ']') : NULL;
+	if (end != NULL) {
+		fprintf(out, "%.*s", (int)(end - address - 1), address + 1);
+	} else {
+		fprintf(out, "%s", symbol);
+	}
+	return;
+}
+
+//lets the next waiter of 'lock' retry if the lock is free
+void lock_wakeNext(SmartLock* lock) {
+	waiter_t* next = rag_takeWaiter(lock);
+	if (next != NULL) {
+		next->wake(next);
+	}
+}
+
+/*
+ * Returns 1 if the calling thread's last rejected request was the same
+ * request of 'tid' for 'lock', or for the hold 'wanted' of it, and no edge
+ * has changed since; the request would close the same cycle again. A victim
+ * policy other than VICTIM_REQUESTER may abort another request instead, so
+ * the answer is then always 0.
+ */
+_Bool lock_isRejected(SmartLock* lock, unsigned long tid, hold_t* wanted) {
+
+	rejection_t* last = &lastRejection;
+	if (last->lock != lock || last->tid != tid || victimPolicy != VICTIM_REQUESTER) {
+		return false;
+	}
+	if (wanted != NULL && (wanted->mode != last->wanted.mode || wanted->start != last->wanted.start
+			|| wanted->end != last->wanted.end)) {
+		return false;
+	}
+	return __atomic_load_n(&graphVersion, __ATOMIC_ACQUIRE) == last->version;
+}
+
+//remembers a rejected request whose cycle check saw the version 'checked', if removing
+//its request edge was the only change to the graph since
+void lock_rememberRejection(SmartLock* lock, unsigned long tid, hold_t* wanted, unsigned long long checked) {
+
+	rejection_t* last = &lastRejection;
+	if (changedVersion != checked + 1) {
+		last->lock = NULL;
+		return;
+	}
+
+	last->tid = tid;
+	last->lock = lock;
+	memset(&last->wanted, 0, sizeof(hold_t));
+	if (wanted != NULL) {
+		last->wanted.mode = wanted->mode;
+		last->wanted.start = wanted->start;
+		last->wanted.end = wanted->end;
+	}
+	last->version = changedVersion;
+}
+
+//unlocks a given SmartLock object
+void unlock(SmartLock* lock) {
+
+	record_event(lock, get_actor(), RECORD_RELEASE);
+	if (lock_releaseFast(lock)) {
+		return;
+	}
+
+	//remove the assignment edge associating the lock with a thread
+	waiter_t* woken = rag_removeAssignment(lock);
+
+	//let the longest waiting requester retry, or tell it the lock is now its own,
+	//along with any requester whose blocked cycle ran through the lock
+	rag_wakeAll(woken);
+}
+
+/*
+ * Cleanup any dynamic allocated memory for SmartLock to avoid memory leak
+ * You can assume that cleanup will always be the last function call
+ * in main function of the test cases.
+ */
+void cleanup() {
+
+	//iterate through and release each resource object
+	struct resource_t* temp_res = resources;
+	for (struct resource_t* curr = resources; temp_res != NULL; curr = temp_res) {
+		temp_res = curr->next;
+		while (curr->sleepers != NULL) {
+			rag_unindexWaiter(curr->sleepers->waiter);
+		}
+		while (curr->holds != NULL) {
+			hold_t* hold = curr->holds;
+			curr->holds = hold->next;
+			free(hold);
+		}
+		free(curr);
+	}
+
+	//iterate through and release each thread object
+	struct thread_t* temp_thr = threads;
+	for (struct thread_t* curr = threads; temp_thr != NULL; curr = temp_thr) {
+		temp_thr = curr->next;
+		free(curr);
+	}
+
+	//iterate through and release each pooled thread object
+	temp_thr = threadPool;
+	for (struct thread_t* curr = threadPool; temp_thr != NULL; curr = temp_thr) {
+		temp_thr = curr->next;
+		free(curr);
+	}
+
+	//finish any recording, then iterate through and release each recorder
+	if (recording) {
+		stop_recording();
+	}
+	struct recorder_t* temp_rec = recorders;
+	for (struct recorder_t* curr = recorders; temp_rec != NULL; curr = temp_rec) {
+		temp_rec = curr->next;
+		free(curr);
+	}
+	free(recordPrefix);
+
+	resources = NULL;
+	threads = NULL;
+	threadPool = NULL;
+	memset(waitEdges, 0, sizeof(waitEdges));
+	memset(waitReach, 0, sizeof(waitReach));
+	memset(waitSlots, 0, sizeof(waitSlots));
+	memset(waitThreads, 0, sizeof(waitThreads));
+	rag_changeGraph();
+	unslotted = 0;
+	resourceCount = 0;
+	threadCount = 0;
+	recorders = NULL;
+	recordPrefix = NULL;
+}
+
+//creates the global semaphores exactly once, whichever thread gets here first
+void rag_setup() {
+	pthread_once(&setupOnce, rag_createSemaphores);
+}
+
+void rag_createSemaphores() {
+	sem_init(&assign_mutex,   0, 1);
+	sem_init(&assign_mutexRw, 0, 1);
+	sem_init(&profile_mutex,  0, 1);
+	sem_init(&record_mutex,   0, 1);
+	sem_init(&stats_mutex,    0, 1);
+	pthread_key_create(&recordKey, record_retire);
+	pthread_key_create(&threadKey, rag_exitThread);
+	pthread_key_create(&statsKey, stats_retire);
+}
+
+//creates a new resource node in a RAG with default parameters
+struct resource_t* rag_createResource() {
+	struct resource_t* newResource = malloc(sizeof(resource_t));
+	newResource->assignment = NULL;
+	newResource->lock = NULL;
+	newResource->next = NULL;
+	newResource->sleepers = NULL;
+	newResource->acquired.tv_sec = 0;
+	newResource->acquired.tv_nsec = 0;
+	newResource->holds = NULL;
+	newResource->kind = RESOURCE_SINGLE;
+	newResource->requesters = 0;
+	return newResource;
+}
+
+//creates a new process node in a RAG with default parameters, reusing a pooled node if possible
+struct thread_t* rag_createThread() {
+
+	rag_writerWait();
+
+	struct thread_t* newThread = threadPool;
+	if (newThread != NULL) {
+		threadPool = newThread->next;
+	}
+
+	rag_writerSignal();
+
+	if (newThread == NULL) {
+		newThread = malloc(sizeof(thread_t));
+	}
+	newThread->request = NULL;
+	newThread->tid = 0;
+	newThread->next = NULL;
+	newThread->held = 0;
+	newThread->since = 0;
+	newThread->priority = 0;
+	newThread->wanted.thread = newThread;
+	newThread->wanted.mode = MODE_X;
+	newThread->slot = -1;
+	return newThread;
+}
+
+/*
+ * Gives 'lock' a resource node the first time a request finds it held or
+ * contended. A hold taken without the RAG becomes an assignment edge to its
+ * holder, whose thread node is added if needed; from then on 'owner' stays
+ * LOCK_REGISTERED and the lock is managed through the RAG alone.
+ */
+void rag_register(SmartLock* lock) {
+
+	if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) == LOCK_REGISTERED) {
+		return;
+	}
+
+	rag_setup();
+	struct resource_t* newResource = rag_createResource();
+	struct thread_t* newThread = rag_createThread();
+
+	rag_writerWait();
+
+	//a holder releasing meanwhile sees the lock registered and releases through the RAG
+	unsigned long owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+	while (owner != LOCK_REGISTERED && !__atomic_compare_exchange_n(&lock->owner, &owner,
+		LOCK_REGISTERED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	if (owner != LOCK_REGISTERED) {
+		newResource->lock = lock;
+		rag_linkResource(newResource);
+		lock->held = owner != 0;
+
+		if (owner != 0) {
+			thread_t* holder = rag_getThread(owner);
+			if (holder == NULL) {
+				holder = newThread;
+				holder->tid = owner;
+				rag_linkThread(holder);
+				newThread = NULL;
+			}
+			rag_setHolder(newResource, holder);
+		}
+		newResource = NULL;
+	}
+
+	//an unused node goes to the pool rather than back to the heap
+	if (newThread != NULL) {
+		newThread->next = threadPool;
+		threadPool = newThread;
+	}
+
+	rag_writerSignal();
+	free(newResource);
+}
+
+//adds a new thread to the thread list in the RAG, unless a registration added it meanwhile
+void rag_addThread(unsigned long tid) {
+	struct thread_t* newThread = rag_createThread();
+
+	rag_writerWait();
+
+	if (rag_getThread(tid) == NULL) {
+		newThread->tid = tid;
+		rag_linkThread(newThread);
+	} else {
+		newThread->next = threadPool;
+		threadPool = newThread;
+	}
+
+	rag_writerSignal();
+	return;
+}
+
+//appends a resource node to the resource list; the writer semaphore must be held
+void rag_linkResource(resource_t* newResource) {
+
+	if (resources != NULL) {
+		struct resource_t* curr = resources;
+		while (curr->next != NULL) {
+			curr = curr->next;
+		}
+		curr->next = newResource;
+	} else {
+		resources = newResource;
+	}
+
+	__atomic_store_n(&resourceCount, resourceCount + 1, __ATOMIC_RELAXED);
+}
+
+//appends a thread node to the thread list; the writer semaphore must be held
+void rag_linkThread(thread_t* newThread) {
+
+	if (threads != NULL) {
+		struct thread_t* curr = threads;
+		while (curr->next != NULL) {
+			curr = curr->next;
+		}
+		curr->next = newThread;
+	} else {
+		threads = newThread;
+	}
+	rag_takeSlot(newThread);
+
+	__atomic_store_n(&threadCount, threadCount + 1, __ATOMIC_RELAXED);
+}
+
+//removes the resource of 'lock' from the resource list in the RAG
+void rag_removeResource(SmartLock* lock) {
+
+	struct resource_t* removed = NULL;
+
+	rag_writerWait();
+
+	if (resources != NULL && resources->lock == lock) {
+		removed = resources;
+		resources = removed->next;
+	} else if (resources != NULL) {
+		struct resource_t* curr = resources;
+		while (curr->next != NULL && curr->next->lock != lock) {
+			curr = curr->next;
+		}
+		removed = curr->next;
+		if (removed != NULL) {
+			curr->next = removed->next;
+		}
+	}
+	if (removed != NULL) {
+		__atomic_store_n(&resourceCount, resourceCount - 1, __ATOMIC_RELAXED);
+		rag_changeGraph();
+	}
+
+	rag_writerSignal();
+	free(removed);
+	return;
+}
+
+//moves the thread 'tid' from the thread list to the pool unless it holds or requests a lock
+_Bool rag_removeThread(unsigned long tid) {
+
+	_Bool isRemoved = true;
+
+	rag_writerWait();
+
+	struct thread_t* prev = NULL;
+	struct thread_t* curr = threads;
+	while (curr != NULL && curr->tid != tid) {
+		prev = curr;
+		curr = curr->next;
+	}
+
+	if (curr != NULL) {
+		_Bool isInUse = curr->request != NULL || curr->held > 0;
+		for (struct resource_t* res = resources; res != NULL; res = res->next) {
+			isInUse = isInUse || res->assignment == curr;
+		}
+
+		if (isInUse) {
+			isRemoved = false;
+		} else {
+			if (prev != NULL) {
+				prev->next = curr->next;
+			} else {
+				threads = curr->next;
+			}
+			rag_freeSlot(curr);
+			rag_changeGraph();
+			curr->next = threadPool;
+			threadPool = curr;
+			__atomic_store_n(&threadCount, threadCount - 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	rag_writerSignal();
+	return isRemoved;
+}
+
+//removes the node of an exiting thread, which stays if the thread still holds a lock
+void rag_exitThread(void* arg) {
+	//a lock taken by a later destructor sets the key again
+	threadKeySet = false;
+	rag_removeThread(pthread_self());
+}
+
+//retrieves a resource from the resource list in the RAG
+resource_t* rag_getResource(SmartLock* lock) {
+	struct resource_t* curr = resources;
+	while (curr != NULL) {
+		if (curr->lock == lock) {
+			return curr;
+		}
+		curr = curr->next;
+	}
+	return curr;
+}
+
+//retrieves a thread from the thread list in the RAG
+thread_t* rag_getThread(unsigned long tid) {
+	struct thread_t* curr = threads;
+	while (curr != NULL) {
+		if (curr->tid == tid) {
+			return curr;
+		}
+		curr = curr->next;
+	}
+	return curr;
+}
+
+//returns 1 if the lock has been assigned to a thread; else, 0
+_Bool rag_isAssigned(SmartLock* lock) {
+
+	_Bool assignmentExists = false;
+
+	rag_readerWait();
+
+	resource_t* resourceToCheck = rag_getResource(lock);
+	assignmentExists = resourceToCheck->assignment != NULL;
+
+	rag_readerSignal();
+
+	return assignmentExists;
+}
+
+//sets a request edge from 'tid' to 'lock'
+void rag_setRequest(unsigned long tid, SmartLock* lock) {
+	rag_setHoldRequest(tid, lock, NULL);
+}
+
+//sets a request edge from 'tid' to 'lock' for the hold 'wanted', if given; a request
+//for an intent lock is raised to cover the mode 'tid' already holds it in
+void rag_setHoldRequest(unsigned long tid, SmartLock* lock, hold_t* wanted) {
+
+	rag_readerWait();
+
+	thread_t* threadToSet = rag_getThread(tid);
+	resource_t* resourceToSet = rag_getResource(lock);
+
+	rag_readerSignal();
+	rag_writerWait();
+
+	if (threadToSet->request != NULL) {
+		threadToSet->request->requesters--;
+	}
+	threadToSet->request = resourceToSet;
+	resourceToSet->requesters++;
+	rag_changeGraph();
+
+	if (wanted != NULL) {
+		threadToSet->wanted = *wanted;
+		threadToSet->wanted.thread = threadToSet;
+
+		hold_t* hold = rag_getHold(resourceToSet, threadToSet);
+		if (resourceToSet->kind == RESOURCE_INTENT && hold != NULL) {
+			threadToSet->wanted.mode = modeUnion[hold->mode][wanted->mode];
+		}
+	}
+	rag_updateWaits(threadToSet);
+
+	rag_writerSignal();
+	return;
+}
+
+//sets an assignment edge from 'lock' to 'tid' if the lock is free; else queues 'waiter'
+_Bool rag_tryAssignment(unsigned long tid, SmartLock* lock, waiter_t* waiter) {
+
+	_Bool isAssigned = false;
+	waiter_t* woken = NULL;
+
+	rag_readerWait();
+
+	resource_t* resourceToSet = rag_getResource(lock);
+	thread_t* threadToSet = rag_getThread(tid);
+
+	rag_readerSignal();
+	rag_writerWait();
+
+	//the request edge goes with the same write, or a walk could see the
+	//thread both holding and requesting the lock and loop on it
+	if (!lock->held) {
+		if (threadToSet->request != NULL) {
+			woken = rag_takeSleepers(threadToSet->request);
+			rag_clearRequest(threadToSet);
+		}
+		lock->held = true;
+		rag_setHolder(resourceToSet, threadToSet);
+		isAssigned = true;
+	} else if (waiter != NULL) {
+		rag_queueWaiter(lock, tid, waiter);
+	}
+
+	rag_writerSignal();
+	rag_wakeAll(woken);
+	return isAssigned;
+}
+
+//adds the hold 'wanted' of 'lock' for 'tid' unless a hold is in its way; else queues
+//'waiter'. A hold 'tid' already has of an intent lock is raised to cover both modes
+_Bool rag_tryHold(unsigned long tid, SmartLock* lock, int kind, hold_t* wanted, waiter_t* waiter) {
+
+	_Bool isHeld = true;
+	waiter_t* woken = NULL;
+
+	rag_readerWait();
+
+	resource_t* resourceToSet = rag_getResource(lock);
+	thread_t* threadToSet = rag_getThread(tid);
+
+	rag_readerSignal();
+	rag_writerWait();
+
+	resourceToSet->kind = kind;
+	hold_t request = *wanted;
+	request.thread = threadToSet;
+
+	hold_t* own = NULL;
+	if (kind == RESOURCE_INTENT) {
+		own = rag_getHold(resourceToSet, threadToSet);
+		if (own != NULL) {
+			request.mode = modeUnion[own->mode][request.mode];
+		}
+	}
+
+	//ranges are sorted by start, so the search ends at the first range past the request
+	hold_t** place = &resourceToSet->holds;
+	for (hold_t* curr = resourceToSet->holds; curr != NULL; curr = curr->next) {
+		if (kind == RESOURCE_RANGE && curr->start >= request.end) {
+			break;
+		}
+		if (rag_isInWay(resourceToSet, curr, &request)) {
+			isHeld = false;
+			break;
+		}
+		if (kind == RESOURCE_RANGE) {
+			place = &curr->next;
+		}
+	}
+
+	if (isHeld) {
+		if (threadToSet->request != NULL) {
+			woken = rag_takeSleepers(threadToSet->request);
+			rag_clearRequest(threadToSet);
+		}
+
+		if (own != NULL) {
+			own->mode = request.mode;
+		} else {
+			hold_t* hold = malloc(sizeof(hold_t));
+			*hold = request;
+			hold->acquired.tv_sec = 0;
+			hold->acquired.tv_nsec = 0;
+			if (watchdogRunning) {
+				clock_gettime(CLOCK_MONOTONIC, &hold->acquired);
+			}
+			hold->next = *place;
+			*place = hold;
+			if (threadToSet->held++ == 0) {
+				threadToSet->since = ++holdClock;
+			}
+		}
+		rag_updateRequesters(resourceToSet);
+	} else if (waiter != NULL) {
+		rag_queueWaiter(lock, tid, waiter);
+	}
+
+	rag_writerSignal();
+	rag_wakeAll(woken);
+	return isHeld;
+}
+
+//removes the hold of 'lock' by 'tid', for the range of 'released' if given, returning
+//every waiter of the lock followed by the requesters whose blocked cycle ran through it
+waiter_t* rag_releaseHold(unsigned long tid, SmartLock* lock, hold_t* released) {
+
+	hold_t* removed = NULL;
+
+	rag_readerWait();
+
+	resource_t* resourceToRemove = rag_getResource(lock);
+	thread_t* holder = rag_getThread(tid);
+
+	rag_readerSignal();
+	rag_writerWait();
+
+	for (hold_t** curr = &resourceToRemove->holds; *curr != NULL; curr = &(*curr)->next) {
+		if ((*curr)->thread == holder && (released == NULL
+			|| ((*curr)->start == released->start && (*curr)->end == released->end))) {
+			removed = *curr;
+			*curr = removed->next;
+			holder->held--;
+			break;
+		}
+	}
+	rag_updateRequesters(resourceToRemove);
+
+	//any waiter may fit beside the holds that are left
+	waiter_t* woken = lock->waiters;
+	lock->waiters = NULL;
+	waiter_t** tail = &woken;
+	while (*tail != NULL) {
+		tail = &(*tail)->next;
+	}
+	*tail = rag_takeSleepers(resourceToRemove);
+
+	rag_writerSignal();
+	free(removed);
+	return woken;
+}
+
+//returns 1 if 'hold' keeps the thread of 'wanted' from taking that hold of the same lock;
+//a held range is in the way of an overlapping request even by its own holder
+_Bool rag_isInWay(resource_t* resource, hold_t* hold, hold_t* wanted) {
+	if (resource->kind == RESOURCE_RANGE) {
+		return hold->start < wanted->end && wanted->start < hold->end;
+	}
+	return hold->thread != wanted->thread && !modeCompatible[hold->mode][wanted->mode];
+}
+
+//retrieves the first hold 'thread' has of the lock of 'resource', or NULL
+hold_t* rag_getHold(resource_t* resource, thread_t* thread) {
+	for (hold_t* curr = resource->holds; curr != NULL; curr = curr->next) {
+		if (curr->thread == thread) {
+			return curr;
+		}
+	}
+	return NULL;
+}
+
+//appends 'waiter' for 'tid' to the queue of 'lock'; the writer semaphore must be held
+void rag_queueWaiter(SmartLock* lock, unsigned long tid, waiter_t* waiter) {
+
+	waiter->tid = tid;
+	waiter->granted = false;
+	waiter->aborted = false;
+	waiter->next = NULL;
+	if (lock->waiters != NULL) {
+		waiter_t* curr = lock->waiters;
+		while (curr->next != NULL) {
+			curr = curr->next;
+		}
+		curr->next = waiter;
+	} else {
+		lock->waiters = waiter;
+	}
+}
+
+//moves the assignment edge of 'resource' to 'holder', keeping the threads' hold counts
+void rag_setHolder(resource_t* resource, thread_t* holder) {
+
+	if (resource->assignment != NULL) {
+		resource->assignment->held--;
+	}
+	resource->assignment = holder;
+	if (holder != NULL && holder->held++ == 0) {
+		holder->since = ++holdClock;
+	}
+	rag_updateRequesters(resource);
+
+	//timestamp the hold for the watchdog; an unknown start is left at zero
+	if (holder != NULL && watchdogRunning) {
+		clock_gettime(CLOCK_MONOTONIC, &resource->acquired);
+	} else {
+		resource->acquired.tv_sec = 0;
+		resource->acquired.tv_nsec = 0;
+	}
+	return;
+}
+
+//samples the RAG every watchdog period until stopped
+void* rag_watchdog(void* arg) {
+
+	while (true) {
+		struct timespec wakeup;
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_sec += watchdogPeriod / 1000;
+		wakeup.tv_nsec += (watchdogPeriod % 1000) * 1000000;
+		if (wakeup.tv_nsec >= 1000000000) {
+			wakeup.tv_sec++;
+			wakeup.tv_nsec -= 1000000000;
+		}
+
+		if (sem_timedwait(&watchdogStop, &wakeup) == 0) {
+			return NULL;
+		}
+		rag_reportLongHolds();
+	}
+}
+
+//reports every lock held longer than the watchdog threshold, with its holder and waiters
+void rag_reportLongHolds() {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	rag_readerWait();
+
+	for (resource_t* res = resources; res != NULL; res = res->next) {
+		if (res->assignment != NULL && res->acquired.tv_sec != 0) {
+			long heldMs = (now.tv_sec - res->acquired.tv_sec) * 1000
+				+ (now.tv_nsec - res->acquired.tv_nsec) / 1000000;
+			if (heldMs >= watchdogThreshold) {
+				rag_reportHold(res, res->assignment, NULL, heldMs);
+			}
+		}
+
+		//an intent or range lock has a hold for each holder instead
+		for (hold_t* hold = res->holds; hold != NULL; hold = hold->next) {
+			if (hold->acquired.tv_sec == 0) {
+				continue;
+			}
+			long heldMs = (now.tv_sec - hold->acquired.tv_sec) * 1000
+				+ (now.tv_nsec - hold->acquired.tv_nsec) / 1000000;
+			if (heldMs >= watchdogThreshold) {
+				rag_reportHold(res, hold->thread, hold, heldMs);
+			}
+		}
+	}
+	fflush(watchdogOut);
+
+	rag_readerSignal();
+	return;
+}
+
+//writes the watchdog line for a long hold of 'resource' by 'holder', naming the range
+//or mode of 'hold' if given
+void rag_reportHold(resource_t* resource, thread_t* holder, hold_t* hold, long heldMs) {
+
+	fprintf(watchdogOut, "smartlock: lock %p", (void*)resource->lock);
+	if (hold != NULL && resource->kind == RESOURCE_RANGE) {
+		fprintf(watchdogOut, " bytes %llu to %llu", hold->start, hold->end - 1);
+	} else if (hold != NULL) {
+		fprintf(watchdogOut, " in mode %s", modeNames[hold->mode]);
+	}
+	fprintf(watchdogOut, " held by %lu for %ld ms; waiters:", holder->tid, heldMs);
+	for (thread_t* thr = threads; thr != NULL; thr = thr->next) {
+		if (thr->request == resource) {
+			fprintf(watchdogOut, " %lu", thr->tid);
+		}
+	}
+	fprintf(watchdogOut, "\n");
+}
+
+//removes any request edge associated with 'tid', waking requesters whose cycle used it
+void rag_removeRequest(unsigned long tid) {
+
+	waiter_t* woken = NULL;
+
+	rag_readerWait();
+
+	thread_t* threadToRemove = rag_getThread(tid);
+
+	rag_readerSignal();
+	rag_writerWait();
+
+	if (threadToRemove->request != NULL) {
+		woken = rag_takeSleepers(threadToRemove->request);
+	}
+	rag_clearRequest(threadToRemove);
+
+	rag_writerSignal();
+	rag_wakeAll(woken);
+	return;
+}
+
+//removes any assignment edge associated with 'lock' and dequeues its next waiter;
+//in handoff mode, the edge and the lock are given to that waiter instead. Returns
+//that waiter followed by the requesters whose blocked cycle ran through the lock
+waiter_t* rag_removeAssignment(SmartLock* lock) {
+
+	rag_readerWait();
+
+	resource_t* resourceToRemove = rag_getResource(lock);
+
+	rag_readerSignal();
+	rag_writerWait();
+
+	waiter_t* next = lock->waiters;
+	if (next != NULL) {
+		lock->waiters = next->next;
+	}
+
+	if (next != NULL && lock->handoff) {
+		thread_t* nextThread = rag_getThread(next->tid);
+		rag_clearRequest(nextThread);
+		rag_setHolder(resourceToRemove, nextThread);
+		next->granted = true;
+		stats_add(&stats_get()->acquisitions, 1);
+		record_event(lock, next->tid, RECORD_GRANT);
+	} else {
+		rag_setHolder(resourceToRemove, NULL);
+		lock->held = false;
+	}
+
+	waiter_t* woken = rag_takeSleepers(resourceToRemove);
+	if (next != NULL) {
+		next->next = woken;
+		woken = next;
+	}
+
+	rag_writerSignal();
+	return woken;
+}
+
+//dequeues the next waiter of 'lock' if the lock is free
+waiter_t* rag_takeWaiter(SmartLock* lock) {
+
+	waiter_t* next = NULL;
+
+	rag_writerWait();
+
+	if (!lock->held && lock->waiters != NULL) {
+		next = lock->waiters;
+		lock->waiters = next->next;
+	}
+
+	rag_writerSignal();
+	return next;
+}
+
+//removes 'waiter' from the queue of 'lock' and from the wakeup index; returns 0 if it
+//was in neither because a release already dequeued it
+_Bool rag_cancelWaiter(SmartLock* lock, waiter_t* waiter) {
+
+	_Bool isFound = false;
+
+	rag_writerWait();
+
+	for (waiter_t** curr = &lock->waiters; *curr != NULL; curr = &(*curr)->next) {
+		if (*curr == waiter) {
+			*curr = waiter->next;
+			isFound = true;
+			break;
+		}
+	}
+	if (waiter->wakeups != NULL) {
+		rag_unindexWaiter(waiter);
+		isFound = true;
+	}
+
+	rag_writerSignal();
+	return isFound;
+}
+
+//wakes a thread blocked in lock()
+void rag_wakeThread(waiter_t* waiter) {
+	sem_post(&((blocked_t*)waiter)->wakeup);
+}
+
+//wakes every waiter in a list linked through 'next'
+void rag_wakeAll(waiter_t* woken) {
+	while (woken != NULL) {
+		waiter_t* next = woken->next;
+		woken->wake(woken);
+		woken = next;
+	}
+}
+
+/*
+ * Checks for cycles like rag_checkForCycles, under the writer semaphore so
+ * that no release can slip in unnoticed. If the request of 'tid' would close
+ * a cycle, its request edge is removed and 'waiter' is indexed under each
+ * resource on the cycle, to be woken when any of them changes.
+ */
+_Bool rag_parkUnsafe(unsigned long tid, waiter_t* waiter) {
+
+	waiter_t* woken = NULL;
+
+	rag_writerWait();
+
+	thread_t* requester = rag_getThread(tid);
+	_Bool isCycle = rag_closesCycle(requester);
+
+	if (isCycle) {
+		woken = rag_takeSleepers(requester->request);
+		rag_indexWaiter(requester, waiter);
+		rag_clearRequest(requester);
+	}
+
+	rag_writerSignal();
+	rag_wakeAll(woken);
+	return isCycle;
+}
+
+//adds 'waiter' to the wakeup index of every resource on the cycle closed by 'requester'
+void rag_indexWaiter(thread_t* requester, waiter_t* waiter) {
+
+	int limit = rag_countThreads();
+	thread_t** path = malloc(limit * sizeof(thread_t*));
+	int length = rag_findCycle(requester, path, limit);
+
+	for (int i = 0; i < length; i++) {
+		resource_t* resource = path[i]->request;
+
+		wakeup_t* entry = malloc(sizeof(wakeup_t));
+		entry->waiter = waiter;
+		entry->resource = resource;
+		entry->next = resource->sleepers;
+		entry->sibling = waiter->wakeups;
+		resource->sleepers = entry;
+		waiter->wakeups = entry;
+	}
+
+	free(path);
+	return;
+}
+
+//removes every wakeup index entry of 'waiter'
+void rag_unindexWaiter(waiter_t* waiter) {
+
+	wakeup_t* entry = waiter->wakeups;
+	while (entry != NULL) {
+		wakeup_t* sibling = entry->sibling;
+
+		wakeup_t** curr = &entry->resource->sleepers;
+		while (*curr != entry) {
+			curr = &(*curr)->next;
+		}
+		*curr = entry->next;
+		free(entry);
+
+		entry = sibling;
+	}
+	waiter->wakeups = NULL;
+	return;
+}
+
+//removes every requester indexed under 'resource' and returns them linked through 'next'
+waiter_t* rag_takeSleepers(resource_t* resource) {
+
+	waiter_t* woken = NULL;
+
+	while (resource->sleepers != NULL) {
+		waiter_t* waiter = resource->sleepers->waiter;
+		rag_unindexWaiter(waiter);
+		waiter->next = woken;
+		woken = waiter;
+	}
+	return woken;
+}
+
+//performs semaphore waiting for a read operation
+void rag_readerWait() {
+
+	sem_wait(&assign_mutex);
+	assign_readers++;
+	if (assign_readers == 1) {
+		sem_wait(&assign_mutexRw);
+	}
+	sem_post(&assign_mutex);
+	return;
+}
+
+//performs semaphore signaling for a read operation
+void rag_readerSignal() {
+
+	sem_wait(&assign_mutex);
+	assign_readers--;
+	if (assign_readers == 0) {
+		sem_post(&assign_mutexRw);
+	}
+	sem_post(&assign_mutex);
+	return;
+}
+
+//performs semaphore waiting for a write operation
+void rag_writerWait() {
+	sem_wait(&assign_mutexRw);
+	return;
+}
+
+//performs semaphore signaling for a write operation
+void rag_writerSignal() {
+	sem_post(&assign_mutexRw);
+	return;
+}
+
+//checks if the given thread 'tid' has an associated thread object
+_Bool rag_isNewThread(unsigned long tid) {
+
+	rag_readerWait();
+
+	struct thread_t* curr = threads;
+	while (curr != NULL) {
+		if (curr->tid == tid) {
+			rag_readerSignal();
+			return false;
+		}
+		curr = curr->next;
+	}
+
+	rag_readerSignal();
+	return true;
+}
+
+//checks the graph for any cycles to prevent deadlocks, recording the cycle in 'cycle' if given
+_Bool rag_checkForCycles(unsigned long tid, cycle_step_t* cycle, int* length) {
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	rag_readerWait();
+
+	checkedVersion = graphVersion;
+	thread_t* threadToSearch = rag_getThread(tid);
+	_Bool isCycle = rag_closesCycle(threadToSearch);
+
+	if (cycle != NULL) {
+		*length = isCycle ? rag_recordCycle(threadToSearch, cycle, *length) : 0;
+	}
+
+	rag_readerSignal();
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stats_t* stats = stats_get();
+	stats_add(&stats->cycleChecks, 1);
+	stats_add(&stats->cycleCheckNs, (end.tv_sec - start.tv_sec) * 1000000000LL
+		+ end.tv_nsec - start.tv_nsec);
+	return isCycle;
+}
+
+/*
+ * Breaks the cycle the request of 'tid' would close by aborting the pending
+ * request of another thread on it, if the victim policy prefers one to the
+ * requester. The victim must be queued on the lock it requests; it is woken
+ * with its waiter marked aborted. Returns 0 if the requester is the victim.
+ */
+_Bool rag_abortVictim(unsigned long tid) {
+
+	if (victimPolicy == VICTIM_REQUESTER) {
+		return false;
+	}
+
+	waiter_t* woken = NULL;
+	_Bool isBroken = false;
+
+	rag_writerWait();
+
+	thread_t* requester = rag_getThread(tid);
+	if (!rag_closesCycle(requester)) {
+		isBroken = true;
+	} else {
+		//choose the victim among the threads on the cycle
+		int limit = rag_countThreads();
+		thread_t** path = malloc(limit * sizeof(thread_t*));
+		int length = rag_findCycle(requester, path, limit);
+		thread_t* victim = requester;
+		for (int i = 1; i < length; i++) {
+			if (rag_isBetterVictim(path[i], victim)) {
+				victim = path[i];
+			}
+		}
+		free(path);
+
+		//abort the victim's request if it is waiting in the queue of the lock it wants
+		if (victim != requester) {
+			SmartLock* wanted = victim->request->lock;
+			for (waiter_t** waiter = &wanted->waiters; *waiter != NULL; waiter = &(*waiter)->next) {
+				if ((*waiter)->tid == victim->tid) {
+					woken = *waiter;
+					*waiter = woken->next;
+					woken->aborted = true;
+					stats_add(&stats_get()->rejections, 1);
+					record_event(wanted, victim->tid, RECORD_REJECT);
+					woken->next = rag_takeSleepers(victim->request);
+					rag_clearRequest(victim);
+					isBroken = true;
+					break;
+				}
+			}
+		}
+	}
+
+	rag_writerSignal();
+	rag_wakeAll(woken);
+	return isBroken;
+}
+
+//returns 1 if the victim policy prefers aborting 'candidate' over 'victim'
+_Bool rag_isBetterVictim(thread_t* candidate, thread_t* victim) {
+	switch (victimPolicy) {
+		case VICTIM_YOUNGEST:
+			return candidate->since > victim->since;
+		case VICTIM_FEWEST_HELD:
+			return candidate->held < victim->held;
+		case VICTIM_LOWEST_PRIORITY:
+			return candidate->priority < victim->priority;
+		default:
+			return false;
+	}
+}
+
+//writes up to 'capacity' steps of the cycle closed by 'requester', returning the length of the whole cycle
+int rag_recordCycle(thread_t* requester, cycle_step_t* cycle, int capacity) {
+
+	int limit = rag_countThreads();
+	thread_t** path = malloc(limit * sizeof(thread_t*));
+	int length = rag_findCycle(requester, path, limit);
+
+	for (int i = 0; i < length && i < capacity; i++) {
+		cycle[i].tid = path[i]->tid;
+		cycle[i].lock = path[i]->request->lock;
+	}
+
+	free(path);
+	return length;
+}
+
+/*
+ * Follows the request and assignment edges from 'requester', returning 1 if
+ * they lead back to it. While every thread has a slot, the wait matrix
+ * already holds the answer. While every lock on the way has a single holder the
+ * path is a chain and needs no visited marks. An intent or range lock the
+ * path reaches may have several holders to follow, and a chain with more hops
+ * than there are threads loops without the requester; both are left to
+ * rag_findCycle().
+ */
+_Bool rag_closesCycle(thread_t* requester) {
+
+	if (unslotted == 0) {
+		return rag_hasSlot(waitReach[requester->slot], requester->slot);
+	}
+
+	int limit = rag_countThreads();
+
+	thread_t* curr = requester;
+	for (int i = 0; i <= limit; i++) {
+		if (curr == NULL || curr->request == NULL) {
+			return false;
+		}
+		if (curr->request->kind != RESOURCE_SINGLE) {
+			break;
+		}
+		curr = curr->request->assignment;
+		if (curr == requester) {
+			return true;
+		}
+	}
+	return rag_findCycle(requester, NULL, 0) > 0;
+}
+
+/*
+ * Searches depth first for a path of waits from 'requester' back to it. A
+ * thread waits for the holder of the SmartLock it requests, or for each
+ * holder of an intent or range lock whose hold is in the way of its request.
+ * While every thread has a slot, the wait matrix is searched instead by
+ * rag_searchWaits(). Returns the number of threads on the cycle found,
+ * writing up to 'capacity' of them to 'cycle' from the requester on, or 0 if
+ * there is none.
+ */
+int rag_findCycle(thread_t* requester, thread_t** cycle, int capacity) {
+
+	if (unslotted == 0) {
+		return rag_searchWaits(requester, cycle, capacity);
+	}
+
+	int limit = rag_countThreads();
+
+	//every thread is entered at most once, so neither table outgrows the thread count
+	int slots = 2;
+	while (slots < 2 * limit) {
+		slots *= 2;
+	}
+	thread_t** visited = calloc(slots, sizeof(thread_t*));
+	search_t* path = malloc((limit + 1) * sizeof(search_t));
+
+	int depth = 0;
+	int length = 0;
+	path[depth].thread = requester;
+	path[depth].hold = NULL;
+	path[depth].started = false;
+	depth++;
+	rag_markVisited(visited, slots, requester);
+
+	while (depth > 0) {
+		thread_t* next = rag_nextBlocker(&path[depth - 1]);
+		if (next == NULL) {
+			depth--;
+		} else if (next == requester) {
+			length = depth;
+			break;
+		} else if (depth <= limit && rag_markVisited(visited, slots, next)) {
+			path[depth].thread = next;
+			path[depth].hold = NULL;
+			path[depth].started = false;
+			depth++;
+		}
+	}
+
+	for (int i = 0; i < length && i < capacity; i++) {
+		cycle[i] = path[i].thread;
+	}
+
+	free(visited);
+	free(path);
+	return length;
+}
+
+//returns the next thread the thread of 'search' waits for, or NULL once all were returned
+thread_t* rag_nextBlocker(search_t* search) {
+
+	thread_t* waiter = search->thread;
+	resource_t* resource = waiter->request;
+	if (resource == NULL) {
+		return NULL;
+	}
+
+	if (resource->kind == RESOURCE_SINGLE) {
+		if (search->started) {
+			return NULL;
+		}
+		search->started = true;
+		return resource->assignment;
+	}
+
+	if (!search->started) {
+		search->hold = resource->holds;
+		search->started = true;
+	}
+	while (search->hold != NULL) {
+		hold_t* hold = search->hold;
+		search->hold = hold->next;
+		if (rag_isInWay(resource, hold, &waiter->wanted)) {
+			return hold->thread;
+		}
+	}
+	return NULL;
+}
+
+//adds 'thread' to the open-addressed set 'visited'; returns 0 if it was already there
+_Bool rag_markVisited(thread_t** visited, int slots, thread_t* thread) {
+
+	unsigned long slot = ((unsigned long) thread >> 4) * 0x9E3779B97F4A7C15UL;
+	for (slot >>= 32; ; slot++) {
+		thread_t** entry = &visited[slot & (slots - 1)];
+		if (*entry == thread) {
+			return false;
+		}
+		if (*entry == NULL) {
+			*entry = thread;
+			return true;
+		}
+	}
+}
+
+//raises the graph version after an edge or node changed; the writer semaphore must be held
+void rag_changeGraph() {
+	changedVersion = __atomic_add_fetch(&graphVersion, 1, __ATOMIC_RELEASE);
+}
+
+//returns the number of threads in the RAG
+int rag_countThreads() {
+	int count = 0;
+	for (thread_t* curr = threads; curr != NULL; curr = curr->next) {
+		count++;
+	}
+	return count;
+}
+
+//removes the request edge of 'thread'; the writer semaphore must be held
+void rag_clearRequest(thread_t* thread) {
+	if (thread->request != NULL) {
+		thread->request->requesters--;
+		thread->request = NULL;
+		rag_changeGraph();
+		rag_updateWaits(thread);
+	}
+}
+
+//updates the wait matrix rows of the threads requesting 'resource' after its holds changed
+void rag_updateRequesters(resource_t* resource) {
+
+	rag_changeGraph();
+
+	int remaining = resource->requesters;
+	for (thread_t* curr = threads; curr != NULL && remaining > 0; curr = curr->next) {
+		if (curr->request == resource) {
+			rag_updateWaits(curr);
+			remaining--;
+		}
+	}
+}
+
+/*
+ * Sets the edge row of 'thread' to the threads it now waits for and brings
+ * the reach rows up to date. Added edges are ORed into the rows that reach
+ * the thread. Removed edges may leave those rows reaching too much, so
+ * each of them is recomputed; the rows that do not reach the thread are
+ * unchanged and stand in for their own slots while doing so.
+ */
+void rag_updateWaits(thread_t* thread) {
+
+	int slot = thread->slot;
+	if (slot < 0) {
+		return;
+	}
+
+	unsigned long long edges[WAIT_WORDS] = { 0 };
+	resource_t* resource = thread->request;
+	if (resource != NULL && resource->kind == RESOURCE_SINGLE) {
+		if (resource->assignment != NULL && resource->assignment->slot >= 0) {
+			edges[resource->assignment->slot / 64] |= 1ULL << (resource->assignment->slot % 64);
+		}
+	} else if (resource != NULL) {
+		for (hold_t* hold = resource->holds; hold != NULL; hold = hold->next) {
+			if (hold->thread->slot >= 0 && rag_isInWay(resource, hold, &thread->wanted)) {
+				edges[hold->thread->slot / 64] |= 1ULL << (hold->thread->slot % 64);
+			}
+		}
+	}
+
+	_Bool isChanged = false;
+	_Bool isRemoved = false;
+	unsigned long long added[WAIT_WORDS];
+	for (int w = 0; w < WAIT_WORDS; w++) {
+		isChanged = isChanged || edges[w] != waitEdges[slot][w];
+		isRemoved = isRemoved || (waitEdges[slot][w] & ~edges[w]) != 0;
+		added[w] = edges[w] & ~waitEdges[slot][w];
+		waitEdges[slot][w] = edges[w];
+	}
+	if (!isChanged) {
+		return;
+	}
+
+	//the rows that reach the thread, the thread's own included
+	unsigned long long affected[WAIT_WORDS] = { 0 };
+	affected[slot / 64] |= 1ULL << (slot % 64);
+	for (int w = 0; w < WAIT_WORDS; w++) {
+		for (unsigned long long bits = waitSlots[w]; bits != 0; bits &= bits - 1) {
+			int i = w * 64 + __builtin_ctzll(bits);
+			if (rag_hasSlot(waitReach[i], slot)) {
+				affected[w] |= 1ULL << (i % 64);
+			}
+		}
+	}
+
+	if (!isRemoved) {
+		//each of them now also reaches what the new edges lead to
+		unsigned long long reached[WAIT_WORDS];
+		for (int w = 0; w < WAIT_WORDS; w++) {
+			reached[w] = added[w];
+		}
+		for (int w = 0; w < WAIT_WORDS; w++) {
+			for (unsigned long long bits = added[w]; bits != 0; bits &= bits - 1) {
+				rag_orRow(reached, waitReach[w * 64 + __builtin_ctzll(bits)]);
+			}
+		}
+		for (int w = 0; w < WAIT_WORDS; w++) {
+			for (unsigned long long bits = affected[w]; bits != 0; bits &= bits - 1) {
+				rag_orRow(waitReach[w * 64 + __builtin_ctzll(bits)], reached);
+			}
+		}
+		return;
+	}
+
+	if (!rag_orderReach(affected)) {
+		for (int w = 0; w < WAIT_WORDS; w++) {
+			for (unsigned long long bits = affected[w]; bits != 0; bits &= bits - 1) {
+				rag_closeReach(w * 64 + __builtin_ctzll(bits), affected);
+			}
+		}
+	}
+}
+
+/*
+ * Recomputes the reach rows of the 'affected' slots, each after the rows of
+ * the slots it waits for, as the union of its edges and their reach. Returns
+ * 0 if the affected slots wait for each other in a cycle, which leaves no
+ * such order; the rows must then be recomputed by rag_closeReach().
+ */
+_Bool rag_orderReach(const unsigned long long* affected) {
+
+	int stack[WAIT_ROWS];
+	unsigned long long onStack[WAIT_WORDS] = { 0 };
+	unsigned long long pending[WAIT_WORDS];
+	for (int w = 0; w < WAIT_WORDS; w++) {
+		pending[w] = affected[w];
+	}
+
+	for (int rootWord = 0; rootWord < WAIT_WORDS; rootWord++) {
+		while (pending[rootWord] != 0) {
+			int depth = 0;
+			int root = rootWord * 64 + __builtin_ctzll(pending[rootWord]);
+			stack[depth++] = root;
+			onStack[root / 64] |= 1ULL << (root % 64);
+
+			while (depth > 0) {
+				int top = stack[depth - 1];
+				int next = -1;
+				for (int w = 0; w < WAIT_WORDS && next < 0; w++) {
+					if ((waitEdges[top][w] & onStack[w]) != 0) {
+						return false;
+					}
+					if ((waitEdges[top][w] & pending[w]) != 0) {
+						next = w * 64 + __builtin_ctzll(waitEdges[top][w] & pending[w]);
+					}
+				}
+
+				if (next >= 0) {
+					stack[depth++] = next;
+					onStack[next / 64] |= 1ULL << (next % 64);
+					continue;
+				}
+
+				//every slot it waits for has its final row by now
+				unsigned long long reach[WAIT_WORDS];
+				for (int w = 0; w < WAIT_WORDS; w++) {
+					reach[w] = waitEdges[top][w];
+				}
+				for (int w = 0; w < WAIT_WORDS; w++) {
+					for (unsigned long long bits = waitEdges[top][w]; bits != 0; bits &= bits - 1) {
+						rag_orRow(reach, waitReach[w * 64 + __builtin_ctzll(bits)]);
+					}
+				}
+				for (int w = 0; w < WAIT_WORDS; w++) {
+					waitReach[top][w] = reach[w];
+				}
+
+				pending[top / 64] &= ~(1ULL << (top % 64));
+				onStack[top / 64] &= ~(1ULL << (top % 64));
+				depth--;
+			}
+		}
+	}
+	return true;
+}
+
+//recomputes the reach row of 'slot' from the edge rows; rows outside 'affected' are exact
+void rag_closeReach(int slot, const unsigned long long* affected) {
+
+	unsigned long long reach[WAIT_WORDS] = { 0 };
+	unsigned long long frontier[WAIT_WORDS];
+	rag_advanceFrontier(frontier, waitEdges[slot], reach);
+
+	_Bool isGrowing = true;
+	while (isGrowing) {
+		unsigned long long next[WAIT_WORDS] = { 0 };
+
+		//an unaffected slot brings its whole reach, which needs no further expanding
+		for (int w = 0; w < WAIT_WORDS; w++) {
+			for (unsigned long long bits = frontier[w]; bits != 0; bits &= bits - 1) {
+				int j = w * 64 + __builtin_ctzll(bits);
+				rag_orRow(next, rag_hasSlot(affected, j) ? waitEdges[j] : waitReach[j]);
+			}
+		}
+		isGrowing = rag_advanceFrontier(frontier, next, reach);
+	}
+
+	for (int w = 0; w < WAIT_WORDS; w++) {
+		waitReach[slot][w] = reach[w];
+	}
+}
+
+/*
+ * Searches the edge rows breadth first for the shortest path of waits from
+ * 'requester' back to it; every thread must have a slot. Each level is the
+ * union of the edge rows of the slots first reached by the one before, and
+ * the path is then traced back through the levels. Returns what
+ * rag_findCycle() does.
+ */
+int rag_searchWaits(thread_t* requester, thread_t** cycle, int capacity) {
+
+	//each level after the first holds slots none of the others do
+	unsigned long long (*levels)[WAIT_WORDS] = calloc(WAIT_ROWS, sizeof(*levels));
+	unsigned long long reach[WAIT_WORDS] = { 0 };
+	int slot = requester->slot;
+	levels[0][slot / 64] |= 1ULL << (slot % 64);
+	rag_orRow(reach, levels[0]);
+
+	int depth = 0;
+	int length = 0;
+	while (length == 0) {
+		unsigned long long next[WAIT_WORDS] = { 0 };
+		for (int w = 0; w < WAIT_WORDS; w++) {
+			for (unsigned long long bits = levels[depth][w]; bits != 0; bits &= bits - 1) {
+				rag_orRow(next, waitEdges[w * 64 + __builtin_ctzll(bits)]);
+			}
+		}
+
+		if (rag_hasSlot(next, slot)) {
+			length = depth + 1;
+		} else if (rag_advanceFrontier(levels[depth + 1], next, reach)) {
+			depth++;
+		} else {
+			break;
+		}
+	}
+
+	if (length > 0 && capacity > 0) {
+		cycle[0] = requester;
+	}
+
+	//some slot of each level waits for the step after it
+	int target = slot;
+	for (int i = length - 1; i > 0; i--) {
+		int waiter = -1;
+		for (int w = 0; w < WAIT_WORDS && waiter < 0; w++) {
+			for (unsigned long long bits = levels[i][w]; bits != 0 && waiter < 0; bits &= bits - 1) {
+				int j = w * 64 + __builtin_ctzll(bits);
+				if (rag_hasSlot(waitEdges[j], target)) {
+					waiter = j;
+				}
+			}
+		}
+		target = waiter;
+		if (i < capacity) {
+			cycle[i] = waitThreads[target];
+		}
+	}
+
+	free(levels);
+	return length;
+}
+
+//ORs 'other' into 'row'
+void rag_orRow(unsigned long long* row, const unsigned long long* other) {
+	for (int w = 0; w < WAIT_WORDS; w += WAIT_VECTOR) {
+#if defined(__AVX2__)
+		__m256i bits = _mm256_or_si256(_mm256_loadu_si256((const __m256i*) &row[w]),
+			_mm256_loadu_si256((const __m256i*) &other[w]));
+		_mm256_storeu_si256((__m256i*) &row[w], bits);
+#elif defined(__SSE2__)
+		__m128i bits = _mm_or_si128(_mm_loadu_si128((const __m128i*) &row[w]),
+			_mm_loadu_si128((const __m128i*) &other[w]));
+		_mm_storeu_si128((__m128i*) &row[w], bits);
+#else
+		row[w] |= other[w];
+#endif
+	}
+}
+
+//sets 'frontier' to the slots of 'next' missing from 'reach' and adds them to it; returns 0 if there are none
+_Bool rag_advanceFrontier(unsigned long long* frontier, const unsigned long long* next, unsigned long long* reach) {
+#if defined(__AVX2__)
+	__m256i any = _mm256_setzero_si256();
+	for (int w = 0; w < WAIT_WORDS; w += WAIT_VECTOR) {
+		__m256i seen = _mm256_loadu_si256((const __m256i*) &reach[w]);
+		__m256i bits = _mm256_andnot_si256(seen, _mm256_loadu_si256((const __m256i*) &next[w]));
+		_mm256_storeu_si256((__m256i*) &frontier[w], bits);
+		_mm256_storeu_si256((__m256i*) &reach[w], _mm256_or_si256(seen, bits));
+		any = _mm256_or_si256(any, bits);
+	}
+	return !_mm256_testz_si256(any, any);
+#elif defined(__SSE2__)
+	__m128i any = _mm_setzero_si128();
+	for (int w = 0; w < WAIT_WORDS; w += WAIT_VECTOR) {
+		__m128i seen = _mm_loadu_si128((const __m128i*) &reach[w]);
+		__m128i bits = _mm_andnot_si128(seen, _mm_loadu_si128((const __m128i*) &next[w]));
+		_mm_storeu_si128((__m128i*) &frontier[w], bits);
+		_mm_storeu_si128((__m128i*) &reach[w], _mm_or_si128(seen, bits));
+		any = _mm_or_si128(any, bits);
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF;
+#else
+	unsigned long long any = 0;
+	for (int w = 0; w < WAIT_WORDS; w++) {
+		frontier[w] = next[w] & ~reach[w];
+		reach[w] |= frontier[w];
+		any |= frontier[w];
+	}
+	return any != 0;
+#endif
+}
+
+//gives a newly linked 'thread' a free slot with empty rows, if one is left
+void rag_takeSlot(thread_t* thread) {
+
+	thread->slot = -1;
+	for (int i = 0; i < WAIT_SLOTS; i++) {
+		if (!rag_hasSlot(waitSlots, i)) {
+			waitSlots[i / 64] |= 1ULL << (i % 64);
+			memset(waitEdges[i], 0, sizeof(waitEdges[i]));
+			memset(waitReach[i], 0, sizeof(waitReach[i]));
+			waitThreads[i] = thread;
+			thread->slot = i;
+			return;
+		}
+	}
+	unslotted++;
+}
+
+//frees the slot of a thread leaving the thread list; it neither waits nor is waited for
+void rag_freeSlot(thread_t* thread) {
+	if (thread->slot >= 0) {
+		waitSlots[thread->slot / 64] &= ~(1ULL << (thread->slot % 64));
+		waitThreads[thread->slot] = NULL;
+	} else {
+		unslotted--;
+	}
+	thread->slot = -1;
+}
+
+//returns 1 if the bit of 'slot' is set in 'row'
+_Bool rag_hasSlot(const unsigned long long* row, int slot) {
+	return (row[slot / 64] >> (slot % 64)) & 1;
+}
+
+void* detect_worker(void* arg) {
+	detect_worker_t* self = arg;
+	detect_run(self->run, self->worker);
+	return NULL;
+}
+
+/*
+ * Runs the phases of find_cycles() as one of its workers:
+ *		1. count the edges to each node
+ *		2. trim the nodes nothing left waits for
+ *		3. if many nodes are left, reverse their edges and find the pivot's
+ *		   component by searching forward and backward from it
+ *		4. join the nodes left into parts along their edges
+ *		5. search each part for its components, a part per worker at a time
+ */
+void detect_run(detect_t* run, int worker) {
+
+	detect_countEdges(run, worker);
+	detect_barrier(run);
+	detect_trim(run, worker);
+	detect_barrier(run);
+
+	detect_findPivot(run, worker);
+	if (detect_barrier(run)) {
+		detect_pickPivot(run);
+	}
+	detect_barrier(run);
+	if (run->pivot >= 0) {
+		detect_splitPivot(run, worker);
+	}
+
+	if (run->workers > 1) {
+		detect_joinParts(run, worker);
+	}
+	if (detect_barrier(run)) {
+		detect_groupParts(run);
+	}
+	detect_barrier(run);
+
+	int part;
+	while ((part = __atomic_fetch_add(&run->nextPart, 1, __ATOMIC_RELAXED)) < run->parts) {
+		detect_searchPart(run, part);
+	}
+}
+
+//waits for every worker to finish the phase; returns 1 in one of them, to run a serial step
+_Bool detect_barrier(detect_t* run) {
+	return pthread_barrier_wait(&run->barrier) == PTHREAD_BARRIER_SERIAL_THREAD;
+}
+
+//gives 'worker' its share, 'first' to 'last' - 1, of 'count' items
+void detect_range(detect_t* run, int worker, int count, int* first, int* last) {
+	*first = (long long) count * worker / run->workers;
+	*last = (long long) count * (worker + 1) / run->workers;
+}
+
+//sets 'mark' on 'node'; returns 0 if it was already set
+_Bool detect_claim(detect_t* run, int node, int mark) {
+	return !(__atomic_fetch_or(&run->marks[node], mark, __ATOMIC_RELAXED) & mark);
+}
+
+//returns 1 if 'node' was neither trimmed nor given its component by the pivot search
+_Bool detect_isLive(detect_t* run, int node) {
+	return !(__atomic_load_n(&run->marks[node], __ATOMIC_RELAXED) & (DETECT_TRIMMED | DETECT_DONE));
+}
+
+void detect_countEdges(detect_t* run, int worker) {
+
+	const wait_graph_t* graph = run->graph;
+	int first, last;
+	detect_range(run, worker, graph->nodes, &first, &last);
+
+	for (int node = first; node < last; node++) {
+		for (int edge = graph->offsets[node]; edge < graph->offsets[node + 1]; edge++) {
+			__atomic_add_fetch(&run->inDegree[graph->targets[edge]], 1, __ATOMIC_RELAXED);
+		}
+		run->components[node] = -1;
+	}
+}
+
+//places the reversed edges of each node left after those of the nodes before it;
+//a node's count is then of the edges from nodes left
+void detect_sumDegrees(detect_t* run) {
+
+	run->reverseOffsets[0] = 0;
+	for (int node = 0; node < run->graph->nodes; node++) {
+		int count = detect_isLive(run, node) ? run->inDegree[node] : 0;
+		run->cursor[node] = run->reverseOffsets[node];
+		run->reverseOffsets[node + 1] = run->reverseOffsets[node] + count;
+	}
+}
+
+void detect_reverseEdges(detect_t* run, int worker) {
+
+	const wait_graph_t* graph = run->graph;
+	int first, last;
+	detect_range(run, worker, graph->nodes, &first, &last);
+
+	for (int node = first; node < last; node++) {
+		if (!detect_isLive(run, node)) {
+			continue;
+		}
+		for (int edge = graph->offsets[node]; edge < graph->offsets[node + 1]; edge++) {
+			int target = graph->targets[edge];
+			if (detect_isLive(run, target)) {
+				int at = __atomic_fetch_add(&run->cursor[target], 1, __ATOMIC_RELAXED);
+				run->reverseTargets[at] = node;
+			}
+		}
+	}
+}
+
+/*
+ * Trims nodes that nothing left waits for, as they cannot be on a cycle.
+ * Each trimmed node takes its edges off the counts of the nodes it waits
+ * for, and the worker whose decrement empties a count trims that node next,
+ * so the trees of threads waiting for a cycle, or for a thread that waits
+ * for nothing, are peeled back to it. Nodes a cycle waits for are left to
+ * the component search.
+ */
+void detect_trim(detect_t* run, int worker) {
+
+	const wait_graph_t* graph = run->graph;
+	int first, last;
+	detect_range(run, worker, graph->nodes, &first, &last);
+
+	int capacity = DETECT_BUFFER;
+	int count = 0;
+	int* trimmed = malloc(capacity * sizeof(int));
+
+	for (int node = first; node < last; node++) {
+		if (__atomic_load_n(&run->inDegree[node], __ATOMIC_RELAXED) == 0 && detect_claim(run, node, DETECT_TRIMMED)) {
+			trimmed[count++] = node;
+		}
+
+		while (count > 0) {
+			int current = trimmed[--count];
+
+			//each edge followed here pushes at most one node
+			int needed = count + graph->offsets[current + 1] - graph->offsets[current];
+			if (needed > capacity) {
+				while (needed > capacity) {
+					capacity *= 2;
+				}
+				trimmed = realloc(trimmed, capacity * sizeof(int));
+			}
+
+			for (int edge = graph->offsets[current]; edge < graph->offsets[current + 1]; edge++) {
+				int target = graph->targets[edge];
+				if (__atomic_sub_fetch(&run->inDegree[target], 1, __ATOMIC_RELAXED) == 0
+					&& detect_claim(run, target, DETECT_TRIMMED)) {
+					trimmed[count++] = target;
+				}
+			}
+		}
+	}
+
+	free(trimmed);
+}
+
+//counts the worker's nodes left, readying them for the searches, and finds the
+//one with the most paths through it
+void detect_findPivot(detect_t* run, int worker) {
+
+	const wait_graph_t* graph = run->graph;
+	int first, last;
+	detect_range(run, worker, graph->nodes, &first, &last);
+
+	int live = 0;
+	int best = -1;
+	long long bestScore = 0;
+	for (int node = first; node < last; node++) {
+		if (detect_isLive(run, node)) {
+			long long score = (long long) run->inDegree[node] * (graph->offsets[node + 1] - graph->offsets[node]);
+			if (best < 0 || score > bestScore) {
+				best = node;
+				bestScore = score;
+			}
+			run->parents[node] = node;
+			run->index[node] = -1;
+			live++;
+		}
+	}
+
+	run->pivots[worker] = best;
+	__atomic_add_fetch(&run->live, live, __ATOMIC_RELAXED);
+}
+
+//starts the pivot search if enough nodes are left to keep the workers busy
+void detect_pickPivot(detect_t* run) {
+
+	if (run->workers == 1 || run->live < DETECT_SPLIT) {
+		return;
+	}
+
+	const wait_graph_t* graph = run->graph;
+	long long bestScore = 0;
+	for (int worker = 0; worker < run->workers; worker++) {
+		int node = run->pivots[worker];
+		if (node >= 0) {
+			long long score = (long long) run->inDegree[node] * (graph->offsets[node + 1] - graph->offsets[node]);
+			if (run->pivot < 0 || score > bestScore) {
+				run->pivot = node;
+				bestScore = score;
+			}
+		}
+	}
+
+	run->marks[run->pivot] |= DETECT_FORWARD | DETECT_BACKWARD;
+	run->frontier[0] = run->pivot;
+	run->frontierSize = 1;
+	detect_sumDegrees(run);
+}
+
+/*
+ * Finds the component of the pivot as the nodes it both reaches and is
+ * reached by. In a graph with a giant component, which one worker would
+ * take long to search, the pivot likely lies in it.
+ */
+void detect_splitPivot(detect_t* run, int worker) {
+
+	const wait_graph_t* graph = run->graph;
+	detect_reverseEdges(run, worker);
+	detect_barrier(run);
+
+	detect_search(run, worker, DETECT_FORWARD, graph->offsets, graph->targets);
+	if (detect_barrier(run)) {
+		run->frontier[0] = run->pivot;
+		run->frontierSize = 1;
+	}
+	detect_barrier(run);
+	detect_search(run, worker, DETECT_BACKWARD, run->reverseOffsets, run->reverseTargets);
+
+	int first, last;
+	detect_range(run, worker, graph->nodes, &first, &last);
+
+	int found = 0;
+	for (int node = first; node < last; node++) {
+		if ((run->marks[node] & (DETECT_FORWARD | DETECT_BACKWARD)) == (DETECT_FORWARD | DETECT_BACKWARD)) {
+			found++;
+		}
+	}
+	__atomic_add_fetch(&run->pivotSize, found, __ATOMIC_RELAXED);
+
+	if (detect_barrier(run)) {
+		run->pivotComponent = -1;
+		if (run->pivotSize > 1 || detect_waitsForItself(graph, run->pivot)) {
+			run->pivotComponent = run->count++;
+		}
+	}
+	detect_barrier(run);
+
+	for (int node = first; node < last; node++) {
+		if ((run->marks[node] & (DETECT_FORWARD | DETECT_BACKWARD)) == (DETECT_FORWARD | DETECT_BACKWARD)) {
+			run->marks[node] |= DETECT_DONE;
+			run->components[node] = run->pivotComponent;
+		}
+	}
+	detect_barrier(run);
+}
+
+/*
+ * Marks with 'mark' every node left that the frontier reaches along
+ * 'offsets' and 'targets', a level at a time. Levels too narrow to share
+ * are expanded by worker 0 alone, so that a long path does not cost a
+ * barrier per node.
+ */
+void detect_search(detect_t* run, int worker, int mark, const int* offsets, const int* targets) {
+
+	int size;
+	while ((size = run->frontierSize) > 0) {
+		if (size < DETECT_NARROW) {
+			//every worker has read the size before worker 0 changes it
+			detect_barrier(run);
+			if (worker == 0) {
+				while (run->frontierSize > 0 && run->frontierSize < DETECT_NARROW) {
+					detect_expand(run, 0, run->frontierSize, mark, offsets, targets);
+					detect_swapFrontier(run);
+				}
+			}
+		} else {
+			int first, last;
+			detect_range(run, worker, size, &first, &last);
+			detect_expand(run, first, last, mark, offsets, targets);
+			if (detect_barrier(run)) {
+				detect_swapFrontier(run);
+			}
+		}
+		detect_barrier(run);
+	}
+}
+
+//adds the unmarked neighbours of the frontier's nodes 'first' to 'last' - 1 to the next level
+void detect_expand(detect_t* run, int first, int last, int mark, const int* offsets, const int* targets) {
+
+	int found[DETECT_BUFFER];
+	int count = 0;
+
+	for (int i = first; i < last; i++) {
+		int node = run->frontier[i];
+		for (int edge = offsets[node]; edge < offsets[node + 1]; edge++) {
+			int neighbour = targets[edge];
+			if (!detect_isLive(run, neighbour) || !detect_claim(run, neighbour, mark)) {
+				continue;
+			}
+			if (count == DETECT_BUFFER) {
+				int at = __atomic_fetch_add(&run->nextSize, count, __ATOMIC_RELAXED);
+				memcpy(run->next + at, found, count * sizeof(int));
+				count = 0;
+			}
+			found[count++] = neighbour;
+		}
+	}
+
+	int at = __atomic_fetch_add(&run->nextSize, count, __ATOMIC_RELAXED);
+	memcpy(run->next + at, found, count * sizeof(int));
+}
+
+void detect_swapFrontier(detect_t* run) {
+	int* frontier = run->frontier;
+	run->frontier = run->next;
+	run->next = frontier;
+	run->frontierSize = run->nextSize;
+	run->nextSize = 0;
+}
+
+//joins the nodes left along their edges, then points each straight at its part's root
+void detect_joinParts(detect_t* run, int worker) {
+
+	const wait_graph_t* graph = run->graph;
+	int first, last;
+	detect_range(run, worker, graph->nodes, &first, &last);
+
+	for (int node = first; node < last; node++) {
+		if (!detect_isLive(run, node)) {
+			continue;
+		}
+		for (int edge = graph->offsets[node]; edge < graph->offsets[node + 1]; edge++) {
+			if (detect_isLive(run, graph->targets[edge])) {
+				detect_union(run, node, graph->targets[edge]);
+			}
+		}
+	}
+	detect_barrier(run);
+
+	for (int node = first; node < last; node++) {
+		if (detect_isLive(run, node)) {
+			__atomic_store_n(&run->parents[node], detect_find(run, node), __ATOMIC_RELAXED);
+		}
+	}
+}
+
+//returns the root of the part of 'node', halving the path to it on the way
+int detect_find(detect_t* run, int node) {
+
+	while (true) {
+		int parent = __atomic_load_n(&run->parents[node], __ATOMIC_RELAXED);
+		if (parent == node) {
+			return node;
+		}
+		int grandparent = __atomic_load_n(&run->parents[parent], __ATOMIC_RELAXED);
+		if (grandparent != parent) {
+			__atomic_compare_exchange_n(&run->parents[node], &parent, grandparent, false,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+		node = grandparent;
+	}
+}
+
+//joins the parts of 'first' and 'second'; a root only ever moves under a lower one
+void detect_union(detect_t* run, int first, int second) {
+
+	while (true) {
+		first = detect_find(run, first);
+		second = detect_find(run, second);
+		if (first == second) {
+			return;
+		}
+		if (first < second) {
+			int swap = first;
+			first = second;
+			second = swap;
+		}
+		int expected = first;
+		if (__atomic_compare_exchange_n(&run->parents[first], &expected, second, false,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
+}
+
+//sorts the nodes left into 'order' by part; 'cursor' counts each root's part meanwhile
+void detect_groupParts(detect_t* run) {
+
+	int nodes = run->graph->nodes;
+	int placed = 0;
+
+	//a single worker searches all of them as one part
+	if (run->workers == 1) {
+		for (int node = 0; node < nodes; node++) {
+			if (detect_isLive(run, node)) {
+				run->order[placed++] = node;
+			}
+		}
+		run->partStarts[0] = 0;
+		run->partStarts[1] = placed;
+		run->parts = 1;
+		return;
+	}
+
+	memset(run->cursor, 0, nodes * sizeof(int));
+	for (int node = 0; node < nodes; node++) {
+		if (detect_isLive(run, node)) {
+			run->cursor[run->parents[node]]++;
+		}
+	}
+
+	for (int root = 0; root < nodes; root++) {
+		if (run->cursor[root] > 0) {
+			run->partStarts[run->parts++] = placed;
+			placed += run->cursor[root];
+			run->cursor[root] = run->partStarts[run->parts - 1];
+		}
+	}
+	run->partStarts[run->parts] = placed;
+
+	for (int node = 0; node < nodes; node++) {
+		if (detect_isLive(run, node)) {
+			run->order[run->cursor[run->parents[node]]++] = node;
+		}
+	}
+}
+
+/*
+ * Finds the components of one part depth first, as Tarjan's algorithm does,
+ * with the path kept in 'calls' rather than on the call stack. No other
+ * worker touches the part's nodes, and its stacks fit in its span of
+ * 'order'.
+ */
+void detect_searchPart(detect_t* run, int part) {
+
+	const wait_graph_t* graph = run->graph;
+	int* stack = run->stack + run->partStarts[part];
+	int* calls = run->calls + run->partStarts[part];
+	int stacked = 0;
+	int depth = 0;
+	int counter = 0;
+
+	for (int i = run->partStarts[part]; i < run->partStarts[part + 1]; i++) {
+		int root = run->order[i];
+		if (run->index[root] >= 0) {
+			continue;
+		}
+		detect_enter(run, root, &counter, stack, &stacked);
+		calls[depth++] = root;
+
+		while (depth > 0) {
+			int node = calls[depth - 1];
+			if (run->cursor[node] < graph->offsets[node + 1]) {
+				int target = graph->targets[run->cursor[node]++];
+				if (!detect_isLive(run, target)) {
+					continue;
+				}
+				if (run->index[target] < 0) {
+					detect_enter(run, target, &counter, stack, &stacked);
+					calls[depth++] = target;
+				} else if ((run->marks[target] & DETECT_STACKED) && run->index[target] < run->lowlink[node]) {
+					run->lowlink[node] = run->index[target];
+				}
+				continue;
+			}
+
+			depth--;
+			if (depth > 0 && run->lowlink[node] < run->lowlink[calls[depth - 1]]) {
+				run->lowlink[calls[depth - 1]] = run->lowlink[node];
+			}
+			if (run->lowlink[node] == run->index[node]) {
+				detect_popComponent(run, node, stack, &stacked);
+			}
+		}
+	}
+}
+
+void detect_enter(detect_t* run, int node, int* counter, int* stack, int* stacked) {
+	run->index[node] = *counter;
+	run->lowlink[node] = *counter;
+	(*counter)++;
+	run->cursor[node] = run->graph->offsets[node];
+	run->marks[node] |= DETECT_STACKED;
+	stack[(*stacked)++] = node;
+}
+
+//pops the component rooted at 'node' off the stack, numbering it if it holds a cycle
+void detect_popComponent(detect_t* run, int node, int* stack, int* stacked) {
+
+	int component = -1;
+	if (stack[*stacked - 1] != node || detect_waitsForItself(run->graph, node)) {
+		component = __atomic_fetch_add(&run->count, 1, __ATOMIC_RELAXED);
+	}
+
+	int member;
+	do {
+		member = stack[--(*stacked)];
+		run->marks[member] &= ~DETECT_STACKED;
+		run->components[member] = component;
+	} while (member != node);
+}
+
+_Bool detect_waitsForItself(const wait_graph_t* graph, int node) {
+	for (int edge = graph->offsets[node]; edge < graph->offsets[node + 1]; edge++) {
+		if (graph->targets[edge] == node) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//returns the slot of 'thread' in the open-addressed table, or the empty slot it would take
+int detect_slot(thread_t** table, int slots, thread_t* thread) {
+
+	unsigned long slot = ((unsigned long) thread >> 4) * 0x9E3779B97F4A7C15UL;
+	for (slot >>= 32; ; slot++) {
+		thread_t* entry = table[slot & (slots - 1)];
+		if (entry == thread || entry == NULL) {
+			return slot & (slots - 1);
+		}
+	}
+}
@@ -2,14 +2,266 @@
 #define __KLOCK_H__
 
 #include <pthread.h>
+#include <stdio.h>
+#include <time.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *	results of a lock request:
+ *		LOCK_REJECTED: granting the lock would create a cycle in the RAG
+ *		LOCK_ACQUIRED: the lock was given to the requester
+ *		LOCK_BUSY:     the lock is held and the requester asked not to wait
+ *		LOCK_PARKED:   the lock is held and the requester's waiter was queued
+ */
+enum {
+	LOCK_REJECTED,
+	LOCK_ACQUIRED,
+	LOCK_BUSY,
+	LOCK_PARKED
+};
+
+/*
+ *	defines a queued requester of a held lock; it has:
+ *		wake:    called once the lock is released so the requester can retry
+ *		next:    next waiter in the lock's queue
+ *		tid:     RAG node of the requester
+ *		granted: 1 if the lock was handed to the requester on release
+ *		aborted: 1 if the request was aborted to break another request's cycle
+ *		wakeups: index entries of a requester waiting for its request to be safe
+ */
+typedef struct waiter_t {
+	void (*wake)(struct waiter_t* waiter);
+	struct waiter_t* next;
+	unsigned long tid;
+	int granted;
+	int aborted;
+	struct wakeup_t* wakeups;
+} waiter_t;
+
+/*
+ *	defines a lock; it has:
+ *		held:    1 while a registered lock is held
+ *		handoff: 1 if unlock() hands the lock to its oldest waiter
+ *		waiters: queued requesters of a registered lock
+ *		id:      number given to the lock when it is first recorded, or 0
+ *		owner:   RAG node holding a lock that was never contended, 0 if it
+ *		         is free, or LOCK_REGISTERED once it has a resource node
+ * A lock only joins the RAG when a request first finds it held; until then
+ * it is taken and released with a single atomic operation on 'owner'.
+ */
 typedef struct {
-	 pthread_mutex_t mutex;
+	int held;
+	int handoff;
+	waiter_t* waiters;
+	unsigned int id;
+	unsigned long owner;
 } SmartLock;
 
+#define LOCK_REGISTERED (~0UL)
+
+/*
+ *	defines an array of lock stripes for hash-partitioned data; it has:
+ *		stripes: the stripes, allocated together
+ *		count:   number of stripes
+ */
+typedef struct {
+	SmartLock* stripes;
+	unsigned int count;
+} SmartLockArray;
+
+//initializes a statically allocated SmartLock, as init_lock() does
+#define SMARTLOCK_INITIALIZER { 0, 0, NULL, 0, 0 }
+
+/*
+ *	defines a lock held in one of the MODE_* modes, so that a table, its
+ *	pages and its rows can each have one; it has:
+ *		lock: SmartLock standing for it in the RAG and in reported cycles
+ * Any number of threads can hold it in compatible modes at once.
+ */
+typedef struct {
+	SmartLock lock;
+} SmartIntentLock;
+
+#define SMARTINTENTLOCK_INITIALIZER { SMARTLOCK_INITIALIZER }
+
+/*
+ *	defines a lock on byte ranges of one object, such as a mapped file; it has:
+ *		lock: SmartLock standing for it in the RAG and in reported cycles
+ * Threads hold ranges that do not overlap at once.
+ */
+typedef struct {
+	SmartLock lock;
+} SmartRangeLock;
+
+#define SMARTRANGELOCK_INITIALIZER { SMARTLOCK_INITIALIZER }
+
+/*
+ *	defines one step of a cycle reported by lock_ex(); it has:
+ *		tid:  RAG node on the cycle
+ *		lock: lock that node requests, held by the next step's node
+ */
+typedef struct {
+	unsigned long tid;
+	SmartLock* lock;
+} cycle_step_t;
+
+/*
+ *	defines a wait-for graph for find_cycles(), in compressed rows; it has:
+ *		nodes:   number of nodes, numbered from 0
+ *		offsets: nodes + 1 entries; the edges of node i are those from
+ *		         offsets[i] to offsets[i + 1] - 1
+ *		targets: node each edge leads to, which its node waits for
+ */
+typedef struct {
+	int nodes;
+	const int* offsets;
+	const int* targets;
+} wait_graph_t;
+
+/*
+ *	defines how lock_retry() retries a rejected or busy lock; it has:
+ *		max_attempts: attempts before giving up; 0 for no limit
+ *		deadline:     CLOCK_REALTIME time to give up at; zero for none
+ *		base_ns:      backoff bound after the first failed attempt; a
+ *		              value below 1 is taken as 1
+ *		max_ns:       largest backoff bound; the bound doubles up to it,
+ *		              and a value below base_ns is taken as base_ns
+ *		flags:        RETRY_PARK to wait for a held lock on each attempt
+ *		              rather than count it as failed, RETRY_YIELD to yield
+ *		              the processor repeatedly until the backoff delay
+ *		              has passed rather than sleep through it
+ */
+typedef struct {
+	int max_attempts;
+	struct timespec deadline;
+	long base_ns;
+	long max_ns;
+	int flags;
+} retry_policy_t;
+
+/*
+ *	defines an event read by read_record(); it has:
+ *		ns:     CLOCK_MONOTONIC time of the event in nanoseconds
+ *		lock:   id of the lock, numbered from 1 in the order locks are first recorded
+ *		tid:    RAG node the event concerns
+ *		event:  one of the RECORD_* events
+ *		thread: index of the thread that recorded it
+ */
+typedef struct {
+	unsigned long long ns;
+	unsigned long long lock;
+	unsigned long long tid;
+	unsigned int event;
+	unsigned int thread;
+} lock_record_t;
+
+/*
+ *	defines an open recording file; it has:
+ *		file:    the file
+ *		thread:  index of the thread that recorded it
+ *		tid:     RAG node of that thread
+ *		ns:      time of the last event read
+ *		dropped: events lost because the thread's ring buffer was full
+ */
+typedef struct {
+	FILE* file;
+	unsigned int thread;
+	unsigned long long tid;
+	unsigned long long ns;
+	unsigned long long dropped;
+} record_reader_t;
+
+enum {
+	RECORD_REQUEST,
+	RECORD_GRANT,
+	RECORD_REJECT,
+	RECORD_ABANDON,
+	RECORD_RELEASE
+};
+
+/*
+ *	modes of a SmartIntentLock; a hold is compatible with another thread's
+ *		MODE_IS: intent to hold finer locks shared; all modes but MODE_X
+ *		MODE_IX: intent to hold finer locks exclusively; MODE_IS and MODE_IX
+ *		MODE_S:  shared; MODE_IS and MODE_S
+ *		MODE_X:  exclusive; none
+ */
+enum {
+	MODE_IS,
+	MODE_IX,
+	MODE_S,
+	MODE_X
+};
+
+enum {
+	RETRY_PARK = 1,
+	RETRY_YIELD = 2
+};
+
+enum {
+	VICTIM_REQUESTER,
+	VICTIM_YOUNGEST,
+	VICTIM_FEWEST_HELD,
+	VICTIM_LOWEST_PRIORITY
+};
+
+#define RETRY_POLICY_DEFAULT { 0, { 0, 0 }, 1000, 10000000, RETRY_PARK }
+
 void init_lock(SmartLock* lock);
+void destroy_lock(SmartLock* lock);
+void set_handoff(SmartLock* lock, int enabled);
 int lock(SmartLock* lock);
+int lock_ex(SmartLock* lock, cycle_step_t* cycle, int* length);
+int lock_ordered(SmartLock* lock);
+int lock_retry(SmartLock* lock, const retry_policy_t* policy);
+//a NULL 'abstime' rejects an unsafe request at once instead of waiting forever
+int lock_timed(SmartLock* lock, const struct timespec* abstime);
+int trylock(SmartLock* lock);
+int lock_as(SmartLock* lock, unsigned long tid, waiter_t* waiter);
 void unlock(SmartLock* lock);
+int init_lock_array(SmartLockArray* array, unsigned int count);
+void destroy_lock_array(SmartLockArray* array);
+unsigned int lock_stripe(const SmartLockArray* array, unsigned long hash);
+int lock_stripes(SmartLockArray* array, unsigned int* stripes, int* count);
+void unlock_stripes(SmartLockArray* array, const unsigned int* stripes, int count);
+void init_intent_lock(SmartIntentLock* lock);
+void destroy_intent_lock(SmartIntentLock* lock);
+int lock_mode(SmartIntentLock* lock, int mode);
+int trylock_mode(SmartIntentLock* lock, int mode);
+void unlock_mode(SmartIntentLock* lock);
+void init_range_lock(SmartRangeLock* lock);
+void destroy_range_lock(SmartRangeLock* lock);
+int lock_range(SmartRangeLock* lock, unsigned long long start, unsigned long long length);
+int trylock_range(SmartRangeLock* lock, unsigned long long start, unsigned long long length);
+void unlock_range(SmartRangeLock* lock, unsigned long long start, unsigned long long length);
+int track_request(SmartLock* shadow, cycle_step_t* cycle, int* length);
+void track_acquired(SmartLock* shadow);
+void track_released(SmartLock* shadow);
+void track_abandoned(SmartLock* shadow);
+void set_actor(unsigned long actor);
+unsigned long get_actor();
+int release_actor(unsigned long actor);
+void set_victim_policy(int policy);
+void set_priority(int priority);
+int start_watchdog(long thresholdMs, long periodMs, FILE* out);
+void stop_watchdog();
+int find_cycles(const wait_graph_t* graph, int workers, int* components);
+int find_deadlocks(int workers, FILE* out);
+void set_profile_rate(unsigned int rate);
+void dump_profile(FILE* out);
+int render_metrics(char* buffer, size_t size);
+int start_recording(const char* prefix);
+void stop_recording();
+int open_recording(record_reader_t* reader, const char* path);
+int read_record(record_reader_t* reader, lock_record_t* record);
+void close_recording(record_reader_t* reader);
 void cleanup();
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,658 @@
+#ifndef __KLOCK_HPP__
+#define __KLOCK_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "klock.h"
+
+namespace smartlock {
+
+namespace detail {
+
+//coroutines woken on the calling thread and not yet resumed
+inline std::deque<std::coroutine_handle<>>& woken_coroutines() {
+	thread_local std::deque<std::coroutine_handle<>> woken;
+	return woken;
+}
+
+//resumes 'handle' on the calling thread; a coroutine woken by one that is being
+//resumed here waits until that one suspends or ends, so a convoy of releases
+//runs one after another instead of nesting on the stack
+inline void resume_woken(std::coroutine_handle<> handle) {
+	thread_local bool resuming = false;
+	std::deque<std::coroutine_handle<>>& woken = woken_coroutines();
+	woken.push_back(handle);
+	if (resuming) {
+		return;
+	}
+	resuming = true;
+	while (!woken.empty()) {
+		std::coroutine_handle<> next = woken.front();
+		woken.pop_front();
+		next.resume();
+	}
+	resuming = false;
+}
+
+}
+
+/*
+ *	a SmartLock for C++20 coroutines:
+ *		co_await lock.acquire() suspends the coroutine, not the thread, while the
+ *		lock is held, and resumes it on the thread that releases the lock. The
+ *		awaiting coroutine frame is the requesting node in the RAG, so the result
+ *		is false when granting the lock would deadlock, like lock() returning 0.
+ *		The frame's node leaves the RAG once it holds and waits for nothing.
+ */
+class co_lock {
+public:
+	class awaiter : private waiter_t {
+	public:
+		explicit awaiter(co_lock* lock) : lock_(lock), result_(LOCK_REJECTED), state_(AWAITING) {
+			wake = &awaiter::retry;
+			next = nullptr;
+			tid = 0;
+			granted = 0;
+			aborted = 0;
+			wakeups = nullptr;
+		}
+
+		bool await_ready() const noexcept {
+			return false;
+		}
+
+		//requests the lock as the awaiting frame; stays suspended only if queued and
+		//the request was not already finished by a release
+		bool await_suspend(std::coroutine_handle<> handle) noexcept {
+			handle_ = handle;
+			tid = reinterpret_cast<unsigned long>(handle.address());
+			int result = lock_as(&lock_->lock_, tid, this);
+			if (result != LOCK_PARKED) {
+				result_ = result;
+				return false;
+			}
+			int expected = AWAITING;
+			return state_.compare_exchange_strong(expected, SUSPENDED, std::memory_order_acq_rel);
+		}
+
+		bool await_resume() noexcept {
+			if (result_ == LOCK_ACQUIRED) {
+				lock_->holder_ = tid;
+				return true;
+			}
+			release_actor(tid);
+			return false;
+		}
+
+	private:
+		/*
+		 *	states of an awaiter queued on a held lock:
+		 *		AWAITING:  await_suspend() has not yet decided to suspend
+		 *		SUSPENDED: the coroutine is suspended; retry() resumes it
+		 *		FINISHED:  retry() finished the request before await_suspend() decided,
+		 *		           so the coroutine goes on without suspending
+		 */
+		enum {
+			AWAITING,
+			SUSPENDED,
+			FINISHED
+		};
+
+		//called from unlock(); finishes the request unless it had to queue again
+		static void retry(waiter_t* waiter) {
+			awaiter* self = static_cast<awaiter*>(waiter);
+			int result;
+			if (self->granted) {
+				result = LOCK_ACQUIRED;
+			} else if (self->aborted) {
+				result = LOCK_REJECTED;
+			} else {
+				result = lock_as(&self->lock_->lock_, self->tid, self);
+			}
+			if (result == LOCK_PARKED) {
+				return;
+			}
+
+			//the frame may be gone once the state is left for await_suspend() to see
+			self->result_ = result;
+			std::coroutine_handle<> handle = self->handle_;
+			if (self->state_.exchange(FINISHED, std::memory_order_acq_rel) == SUSPENDED) {
+				detail::resume_woken(handle);
+			}
+		}
+
+		co_lock* lock_;
+		std::coroutine_handle<> handle_;
+		int result_;
+		std::atomic<int> state_;
+	};
+
+	co_lock() : holder_(0) {
+		init_lock(&lock_);
+	}
+
+	~co_lock() {
+		destroy_lock(&lock_);
+	}
+
+	co_lock(const co_lock&) = delete;
+	co_lock& operator=(const co_lock&) = delete;
+
+	awaiter acquire() {
+		return awaiter(this);
+	}
+
+	//releases the lock, letting the holding frame's node go if it holds nothing else
+	void release() {
+		unsigned long holder = holder_;
+		::unlock(&lock_);
+		release_actor(holder);
+	}
+
+	SmartLock* native_handle() {
+		return &lock_;
+	}
+
+private:
+	SmartLock lock_;
+	unsigned long holder_;
+};
+
+namespace detail {
+
+//ranks of the rank-ordered locks held by the calling thread
+inline std::vector<unsigned>& held_ranks() {
+	thread_local std::vector<unsigned> ranks;
+	return ranks;
+}
+
+//returns true if 'rank' is above every rank the calling thread holds
+inline bool may_acquire(unsigned rank) {
+	const std::vector<unsigned>& ranks = held_ranks();
+	return ranks.empty() || *std::max_element(ranks.begin(), ranks.end()) < rank;
+}
+
+//forgets one hold of 'rank'; releasing a rank the thread does not hold is a bug
+inline void release_rank(unsigned rank) {
+	std::vector<unsigned>& ranks = held_ranks();
+	std::vector<unsigned>::iterator held = std::find(ranks.begin(), ranks.end(), rank);
+	assert(held != ranks.end());
+	if (held != ranks.end()) {
+		ranks.erase(held);
+	}
+}
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+}
+
+/*
+ *	avoidance policies: how a basic_lock refuses acquisitions that could deadlock
+ *		rag_avoidance:  a SmartLock, checked for cycles in the RAG
+ *		rank_avoidance: rejects locks not ranked above all locks the thread holds
+ *		no_avoidance:   a plain mutex
+ *	each provides try_lock() and lock() returning a LOCK_* result, and unlock()
+ */
+class rag_avoidance {
+public:
+	rag_avoidance() {
+		init_lock(&lock_);
+	}
+
+	~rag_avoidance() {
+		destroy_lock(&lock_);
+	}
+
+	rag_avoidance(const rag_avoidance&) = delete;
+	rag_avoidance& operator=(const rag_avoidance&) = delete;
+
+	int try_lock() {
+		return ::trylock(&lock_);
+	}
+
+	int lock() {
+		return ::lock(&lock_);
+	}
+
+	void unlock() {
+		::unlock(&lock_);
+	}
+
+	SmartLock* native_handle() {
+		return &lock_;
+	}
+
+private:
+	SmartLock lock_;
+};
+
+class rank_avoidance {
+public:
+	explicit rank_avoidance(unsigned rank) : rank_(rank) {}
+
+	int try_lock() {
+		if (!detail::may_acquire(rank_)) {
+			return LOCK_REJECTED;
+		}
+		if (!mutex_.try_lock()) {
+			return LOCK_BUSY;
+		}
+		detail::held_ranks().push_back(rank_);
+		return LOCK_ACQUIRED;
+	}
+
+	int lock() {
+		if (!detail::may_acquire(rank_)) {
+			return LOCK_REJECTED;
+		}
+		mutex_.lock();
+		detail::held_ranks().push_back(rank_);
+		return LOCK_ACQUIRED;
+	}
+
+	void unlock() {
+		detail::release_rank(rank_);
+		mutex_.unlock();
+	}
+
+	unsigned rank() const {
+		return rank_;
+	}
+
+private:
+	std::mutex mutex_;
+	unsigned rank_;
+};
+
+class no_avoidance {
+public:
+	int try_lock() {
+		return mutex_.try_lock() ? LOCK_ACQUIRED : LOCK_BUSY;
+	}
+
+	int lock() {
+		mutex_.lock();
+		return LOCK_ACQUIRED;
+	}
+
+	void unlock() {
+		mutex_.unlock();
+	}
+
+private:
+	std::mutex mutex_;
+};
+
+/*
+ *	wait policies: how a basic_lock waits for a held lock
+ *		spin_wait:     retries try_lock() in a busy loop
+ *		park_wait:     sleeps until the lock is released
+ *		adaptive_wait: spins briefly, then sleeps
+ */
+struct spin_wait {
+	template <class Avoidance>
+	static int wait(Avoidance& avoidance) {
+		int result = avoidance.try_lock();
+		while (result == LOCK_BUSY) {
+			detail::cpu_relax();
+			result = avoidance.try_lock();
+		}
+		return result;
+	}
+};
+
+struct park_wait {
+	template <class Avoidance>
+	static int wait(Avoidance& avoidance) {
+		return avoidance.lock();
+	}
+};
+
+struct adaptive_wait {
+	static constexpr int spins = 100;
+
+	template <class Avoidance>
+	static int wait(Avoidance& avoidance) {
+		for (int i = 0; i < spins; i++) {
+			int result = avoidance.try_lock();
+			if (result != LOCK_BUSY) {
+				return result;
+			}
+			detail::cpu_relax();
+		}
+		return avoidance.lock();
+	}
+};
+
+/*
+ *	stats policies: what a basic_lock records about its acquisitions
+ *		no_stats:        nothing
+ *		counter_stats:   acquisitions, contentions and rejections
+ *		histogram_stats: counters plus a log2 histogram of wait times
+ *	waits are only timed when the policy's 'timed' flag is set
+ */
+struct no_stats {
+	static constexpr bool timed = false;
+
+	void acquired(std::chrono::nanoseconds) {}
+	void contended() {}
+	void rejected() {}
+};
+
+class counter_stats {
+public:
+	static constexpr bool timed = false;
+
+	void acquired(std::chrono::nanoseconds) {
+		acquisitions_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void contended() {
+		contentions_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void rejected() {
+		rejections_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	std::uint64_t acquisitions() const {
+		return acquisitions_.load(std::memory_order_relaxed);
+	}
+
+	std::uint64_t contentions() const {
+		return contentions_.load(std::memory_order_relaxed);
+	}
+
+	std::uint64_t rejections() const {
+		return rejections_.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<std::uint64_t> acquisitions_{0};
+	std::atomic<std::uint64_t> contentions_{0};
+	std::atomic<std::uint64_t> rejections_{0};
+};
+
+class histogram_stats : public counter_stats {
+public:
+	static constexpr bool timed = true;
+	static constexpr int buckets = 64;
+
+	//counts the wait in bucket i, where 2^(i-1) <= nanoseconds waited < 2^i
+	void acquired(std::chrono::nanoseconds waited) {
+		counter_stats::acquired(waited);
+		std::uint64_t ns = waited.count() > 0 ? waited.count() : 0;
+		int i = std::min<int>(std::bit_width(ns), buckets - 1);
+		histogram_[i].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	std::uint64_t bucket(int i) const {
+		return histogram_[i].load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<std::uint64_t> histogram_[buckets] = {};
+};
+
+/*
+ *	a lock whose deadlock avoidance, waiting and statistics are chosen at compile
+ *	time; policies that do nothing are inlined away. It meets the Lockable
+ *	requirements, so it works with std::lock, std::unique_lock and guard: lock()
+ *	throws std::system_error(resource_deadlock_would_occur) when rejected, and
+ *	try_lock() returns false when the lock is held or would be rejected.
+ */
+template <class Avoidance = rag_avoidance, class Wait = park_wait, class Stats = no_stats>
+class basic_lock {
+public:
+	template <class... Args>
+	explicit basic_lock(Args&&... args) : avoidance_(std::forward<Args>(args)...) {}
+
+	basic_lock(const basic_lock&) = delete;
+	basic_lock& operator=(const basic_lock&) = delete;
+
+	void lock() {
+		std::chrono::nanoseconds waited{0};
+		int result = avoidance_.try_lock();
+		if (result == LOCK_BUSY) {
+			stats_.contended();
+			result = wait(waited);
+		}
+		if (result != LOCK_ACQUIRED) {
+			stats_.rejected();
+			throw std::system_error(std::make_error_code(std::errc::resource_deadlock_would_occur));
+		}
+		stats_.acquired(waited);
+	}
+
+	bool try_lock() {
+		int result = avoidance_.try_lock();
+		if (result == LOCK_BUSY) {
+			stats_.contended();
+		} else if (result == LOCK_REJECTED) {
+			stats_.rejected();
+		} else {
+			stats_.acquired(std::chrono::nanoseconds{0});
+		}
+		return result == LOCK_ACQUIRED;
+	}
+
+	void unlock() {
+		avoidance_.unlock();
+	}
+
+	const Stats& stats() const {
+		return stats_;
+	}
+
+	Avoidance& avoidance() {
+		return avoidance_;
+	}
+
+private:
+	int wait(std::chrono::nanoseconds& waited) {
+		if constexpr (Stats::timed) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			int result = Wait::wait(avoidance_);
+			waited = std::chrono::steady_clock::now() - start;
+			return result;
+		} else {
+			return Wait::wait(avoidance_);
+		}
+	}
+
+	Avoidance avoidance_;
+	[[no_unique_address]] Stats stats_;
+};
+
+using smart_lock = basic_lock<>;
+
+//holds a lock for the lifetime of the guard
+template <class Lock>
+class guard {
+public:
+	explicit guard(Lock& lock) : lock_(lock) {
+		lock_.lock();
+	}
+
+	guard(Lock& lock, std::adopt_lock_t) : lock_(lock) {}
+
+	~guard() {
+		lock_.unlock();
+	}
+
+	guard(const guard&) = delete;
+	guard& operator=(const guard&) = delete;
+
+private:
+	Lock& lock_;
+};
+
+/*
+ *	a SmartLock with a rank fixed at compile time:
+ *		lock(), try_lock() and unlock() take the dynamic path through the RAG
+ *		check; ordered_guard takes the lock without it when the order is known
+ */
+template <unsigned Rank>
+class ranked_lock {
+public:
+	static constexpr unsigned rank = Rank;
+
+	ranked_lock() {
+		init_lock(&lock_);
+	}
+
+	~ranked_lock() {
+		destroy_lock(&lock_);
+	}
+
+	ranked_lock(const ranked_lock&) = delete;
+	ranked_lock& operator=(const ranked_lock&) = delete;
+
+	void lock() {
+		if (::lock(&lock_) != LOCK_ACQUIRED) {
+			throw std::system_error(std::make_error_code(std::errc::resource_deadlock_would_occur));
+		}
+		detail::held_ranks().push_back(Rank);
+	}
+
+	bool try_lock() {
+		if (::trylock(&lock_) != LOCK_ACQUIRED) {
+			return false;
+		}
+		detail::held_ranks().push_back(Rank);
+		return true;
+	}
+
+	//takes the lock without a cycle check; only safe in increasing rank order. A
+	//victim policy can still abort the wait, which throws as lock() does
+	void lock_ordered() {
+		if (::lock_ordered(&lock_) != LOCK_ACQUIRED) {
+			throw std::system_error(std::make_error_code(std::errc::resource_deadlock_would_occur));
+		}
+		detail::held_ranks().push_back(Rank);
+	}
+
+	void unlock() {
+		detail::release_rank(Rank);
+		::unlock(&lock_);
+	}
+
+	SmartLock* native_handle() {
+		return &lock_;
+	}
+
+private:
+	SmartLock lock_;
+};
+
+namespace detail {
+
+template <class... Locks>
+constexpr bool ranks_increase() {
+	const unsigned ranks[] = { Locks::rank... };
+	for (std::size_t i = 1; i < sizeof...(Locks); i++) {
+		if (ranks[i - 1] >= ranks[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+}
+
+/*
+ *	holds ranked_locks taken in an order the compiler can see:
+ *		the locks must be listed in increasing rank, and a guard nested in another
+ *		through then() must rank above it; both are checked with static_assert and
+ *		the locks are taken without the RAG check. If the thread already holds a
+ *		ranked lock at or above the first rank, which the compiler cannot see, the
+ *		locks fall back to the RAG-checked path and the constructor may throw.
+ */
+template <class... Locks>
+class ordered_guard {
+public:
+	static_assert(sizeof...(Locks) > 0, "ordered_guard needs at least one lock");
+	static_assert(detail::ranks_increase<Locks...>(), "ordered_guard locks must be listed in increasing rank");
+
+	static constexpr unsigned first_rank = std::tuple_element_t<0, std::tuple<Locks...>>::rank;
+	static constexpr unsigned last_rank = std::tuple_element_t<sizeof...(Locks) - 1, std::tuple<Locks...>>::rank;
+
+	explicit ordered_guard(Locks&... locks) : locks_(locks...) {
+		if (detail::may_acquire(first_rank)) {
+			lock_ordered();
+		} else if constexpr (sizeof...(Locks) == 1) {
+			(locks.lock(), ...);
+		} else {
+			std::lock(locks...);
+		}
+	}
+
+	~ordered_guard() {
+		std::apply([](Locks&... locks) { (locks.unlock(), ...); }, locks_);
+	}
+
+	ordered_guard(const ordered_guard&) = delete;
+	ordered_guard& operator=(const ordered_guard&) = delete;
+
+	//takes further locks while this guard is held
+	template <class... Next>
+	ordered_guard<Next...> then(Next&... locks) const {
+		static_assert(last_rank < ordered_guard<Next...>::first_rank, "nested ordered_guard must rank above its enclosing guard");
+		return ordered_guard<Next...>(locks...);
+	}
+
+private:
+	//takes the locks from the I-th on without the RAG check; if one throws, those
+	//taken before it are released again
+	template <std::size_t I = 0>
+	void lock_ordered() {
+		if constexpr (I < sizeof...(Locks)) {
+			std::get<I>(locks_).lock_ordered();
+			try {
+				lock_ordered<I + 1>();
+			} catch (...) {
+				std::get<I>(locks_).unlock();
+				throw;
+			}
+		}
+	}
+
+	std::tuple<Locks&...> locks_;
+};
+
+//makes the calling thread request locks as 'actor' until the scope ends
+class actor_scope {
+public:
+	explicit actor_scope(unsigned long actor) : previous_(get_actor()) {
+		set_actor(actor);
+	}
+
+	~actor_scope() {
+		set_actor(previous_);
+	}
+
+	actor_scope(const actor_scope&) = delete;
+	actor_scope& operator=(const actor_scope&) = delete;
+
+private:
+	unsigned long previous_;
+};
+
+}
+
+#endif
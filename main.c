@@ -8,9 +8,12 @@
 SmartLock glocks[2];
 
 void *thread_0(void *arg) {
-  while (lock(&glocks[0]) == 0); // Force locking glocks[0]
+  retry_policy_t retry = RETRY_POLICY_DEFAULT;
+  lock_retry(&glocks[0], &retry); // Force locking glocks[0]
+  printf("thread 0 locked glocks[0]\n");
   sleep(1);
-  while (lock(&glocks[1]) == 0); // Force locking glocks[1]
+  lock_retry(&glocks[1], &retry); // Force locking glocks[1]
+  printf("thread 0 locked glocks[1]\n");
 
   printf("thread 0 is working on critical section for 1 second\n");
   sleep(1);
@@ -26,19 +29,28 @@ void *thread_1(void *arg) {
     int lock1_res = lock(&glocks[1]);
     sleep(2);
     if (lock1_res) {
-      int lock0_res = lock(&glocks[0]);
+      printf("thread 1 locked glocks[1]\n");
+      cycle_step_t cycle[2];
+      int length = 2;
+      int lock0_res = lock_ex(&glocks[0], cycle, &length);
       if (lock0_res) {
+        printf("thread 1 locked glocks[0]\n");
         printf("thread 1 is working on critical section for 1 second\n");
         sleep(1);
         unlock(&glocks[1]);
         unlock(&glocks[0]);
         break;
       } else {
-      	// If thread_1 is not able to lock glocks[0] now, it will also
-      	// unlock glocks[1] and sleep for 1 second before retry so that
-      	// thread_0 can acquire glocks[1]
-        unlock(&glocks[1]);
-        sleep(1);
+      	// If thread_1 is not able to lock glocks[0] now, the last step of
+      	// the reported cycle names the lock it holds that thread_0 waits
+      	// for (glocks[1]). Releasing it hands it straight to thread_0, so
+      	// thread_1 can retry at once instead of sleeping. A cycle too long
+      	// for 'cycle' has no last step, so glocks[1] is released directly
+        if (length > 0 && length <= 2) {
+          unlock(cycle[length - 1].lock);
+        } else {
+          unlock(&glocks[1]);
+        }
       }
     }
   }
@@ -56,6 +68,8 @@ int main(int argc, char *argv[]) {
 
   init_lock(&glocks[0]);
   init_lock(&glocks[1]);
+  set_handoff(&glocks[0], 1);
+  set_handoff(&glocks[1], 1);
 
   pthread_t tids[2];
 
@@ -0,0 +1,444 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include "klock.h"
+
+/*
+ * LD_PRELOAD interposer that tracks every pthread mutex of an unmodified
+ * program in the RAG through a shadow SmartLock, reporting lock orders that
+ * would deadlock before the program blocks on them:
+ *		LD_PRELOAD=./libsmartlock_preload.so ./program
+ * Setting SMARTLOCK_REJECT makes such a pthread_mutex_lock() fail with
+ * EDEADLK instead of going on to block. Counters for each mutex and the time
+ * spent tracking them are printed to stderr when the program exits. Setting
+ * SMARTLOCK_RECORD to a path records the program's mutex events there, as
+ * start_recording() does. A mutex passed to pthread_mutex_destroy() gives
+ * its slot back; mutexes beyond SHADOW_SLOTS live at once are not tracked.
+ */
+
+#define SHADOW_SLOTS 4096
+#define SHADOW_REPORT 16
+#define SHADOW_FREED ((pthread_mutex_t*) 1)
+
+enum {
+	false,
+	true
+};
+
+/*
+ *	defines the shadow of one pthread mutex; it has:
+ *		mutex:        address of the mutex, NULL for a slot never used, or
+ *		              SHADOW_FREED for one freed by pthread_mutex_destroy()
+ *		ready:        1 while the slot holds a tracked mutex
+ *		shadow:       SmartLock standing for the mutex in the RAG
+ *		owner:        RAG node holding the mutex, to see recursive locking
+ *		depth:        recursive acquisitions beyond the first
+ *		acquisitions: times the mutex was acquired
+ *		contentions:  times an acquirer found the mutex held
+ *		cycles:       times acquiring the mutex would have deadlocked
+ *		waitNs:       time acquirers spent blocked on the mutex
+ */
+typedef struct {
+	pthread_mutex_t* volatile mutex;
+	volatile int ready;
+	SmartLock shadow;
+	unsigned long owner;
+	int depth;
+	unsigned long acquisitions;
+	unsigned long contentions;
+	unsigned long cycles;
+	unsigned long long waitNs;
+} shadow_t;
+
+static shadow_t shadows[SHADOW_SLOTS];
+static pthread_mutex_t shadowsMutex = PTHREAD_MUTEX_INITIALIZER;
+static int shadowsFull = false;
+static int shadowsWarned = false;
+static unsigned long freedMutexes = 0;
+static unsigned long freedAcquisitions = 0;
+static unsigned long freedContentions = 0;
+static unsigned long freedCycles = 0;
+static int rejectCycles = false;
+static unsigned long long overheadNs = 0;
+static __thread int inInterposer = false;
+
+static int (*real_lock)(pthread_mutex_t*);
+static int (*real_trylock)(pthread_mutex_t*);
+static int (*real_unlock)(pthread_mutex_t*);
+static int (*real_destroy)(pthread_mutex_t*);
+static int (*real_wait)(pthread_cond_t*, pthread_mutex_t*);
+static int (*real_timedwait)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*);
+
+static void preload_resolve();
+static shadow_t* preload_getShadow(pthread_mutex_t* mutex);
+static shadow_t* preload_findShadow(pthread_mutex_t* mutex, shadow_t** freeSlot);
+static long long preload_now();
+static int preload_acquire(shadow_t* entry, pthread_mutex_t* mutex);
+static void preload_reportCycle(shadow_t* entry, cycle_step_t* cycle, int length);
+
+__attribute__((constructor))
+static void preload_init() {
+	preload_resolve();
+	rejectCycles = getenv("SMARTLOCK_REJECT") != NULL;
+
+	const char* prefix = getenv("SMARTLOCK_RECORD");
+	if (prefix != NULL) {
+		inInterposer = true;
+		start_recording(prefix);
+		inInterposer = false;
+	}
+}
+
+//prints the counters of the mutexes that were contended or would have deadlocked
+__attribute__((destructor))
+static void preload_report() {
+
+	inInterposer = true;
+	stop_recording();
+
+	//the counts of destroyed mutexes were kept when their slots were freed
+	unsigned long mutexes = freedMutexes, acquisitions = freedAcquisitions;
+	unsigned long contentions = freedContentions, cycles = freedCycles;
+	for (int i = 0; i < SHADOW_SLOTS; i++) {
+		if (shadows[i].ready) {
+			mutexes++;
+			acquisitions += shadows[i].acquisitions;
+			contentions += shadows[i].contentions;
+			cycles += shadows[i].cycles;
+		}
+	}
+
+	fprintf(stderr, "smartlock: %lu mutexes, %lu acquisitions, %lu contended, %lu cycles, %llu ns tracking\n",
+		mutexes, acquisitions, contentions, cycles, __atomic_load_n(&overheadNs, __ATOMIC_RELAXED));
+
+	int reported = 0;
+	for (int i = 0; i < SHADOW_SLOTS && reported < SHADOW_REPORT; i++) {
+		shadow_t* entry = &shadows[i];
+		if (entry->ready && (entry->contentions > 0 || entry->cycles > 0)) {
+			fprintf(stderr, "smartlock:   mutex %p: %lu acquisitions, %lu contended, %lu cycles, %llu ns waiting\n",
+				(void*) entry->mutex, entry->acquisitions, entry->contentions, entry->cycles, entry->waitNs);
+			reported++;
+		}
+	}
+}
+
+int pthread_mutex_lock(pthread_mutex_t* mutex) {
+
+	preload_resolve();
+	if (inInterposer) {
+		return real_lock(mutex);
+	}
+
+	shadow_t* entry = preload_getShadow(mutex);
+	if (entry == NULL) {
+		return real_lock(mutex);
+	}
+
+	//a recursive acquisition is already in the RAG
+	if (entry->owner == get_actor()) {
+		int result = real_lock(mutex);
+		if (result == 0) {
+			entry->depth++;
+		}
+		return result;
+	}
+
+	return preload_acquire(entry, mutex);
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* mutex) {
+
+	preload_resolve();
+	int result = real_trylock(mutex);
+	if (result != 0 || inInterposer) {
+		return result;
+	}
+
+	shadow_t* entry = preload_getShadow(mutex);
+	if (entry == NULL) {
+		return result;
+	}
+
+	if (entry->owner == get_actor()) {
+		entry->depth++;
+		return result;
+	}
+
+	//an acquisition that did not wait cannot close a cycle; only record it
+	long long start = preload_now();
+	inInterposer = true;
+	track_acquired(&entry->shadow);
+	inInterposer = false;
+	entry->owner = get_actor();
+	entry->acquisitions++;
+	__atomic_add_fetch(&overheadNs, preload_now() - start, __ATOMIC_RELAXED);
+
+	return result;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t* mutex) {
+
+	preload_resolve();
+	if (inInterposer) {
+		return real_unlock(mutex);
+	}
+
+	shadow_t* entry = preload_getShadow(mutex);
+	if (entry == NULL || entry->owner != get_actor()) {
+		return real_unlock(mutex);
+	}
+
+	if (entry->depth > 0) {
+		entry->depth--;
+		return real_unlock(mutex);
+	}
+
+	//the assignment edge goes before the mutex does, so the next owner finds it gone
+	long long start = preload_now();
+	entry->owner = 0;
+	inInterposer = true;
+	track_released(&entry->shadow);
+	inInterposer = false;
+	__atomic_add_fetch(&overheadNs, preload_now() - start, __ATOMIC_RELAXED);
+
+	return real_unlock(mutex);
+}
+
+//frees the shadow of a destroyed mutex so its slot can be reused, keeping its counts for the report
+int pthread_mutex_destroy(pthread_mutex_t* mutex) {
+
+	preload_resolve();
+	shadow_t* entry = inInterposer ? NULL : preload_findShadow(mutex, NULL);
+	if (entry == NULL) {
+		return real_destroy(mutex);
+	}
+
+	real_lock(&shadowsMutex);
+	freedMutexes++;
+	freedAcquisitions += entry->acquisitions;
+	freedContentions += entry->contentions;
+	freedCycles += entry->cycles;
+	entry->ready = false;
+	__atomic_store_n(&entry->mutex, SHADOW_FREED, __ATOMIC_RELEASE);
+	inInterposer = true;
+	destroy_lock(&entry->shadow);
+	inInterposer = false;
+	__atomic_store_n(&shadowsFull, false, __ATOMIC_RELEASE);
+	real_unlock(&shadowsMutex);
+
+	return real_destroy(mutex);
+}
+
+//a condition wait releases and reacquires the mutex inside the library, so
+//the shadow follows it around the real wait
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+
+	preload_resolve();
+	shadow_t* entry = inInterposer ? NULL : preload_getShadow(mutex);
+	if (entry == NULL || entry->owner != get_actor() || entry->depth > 0) {
+		return real_wait(cond, mutex);
+	}
+
+	entry->owner = 0;
+	inInterposer = true;
+	track_released(&entry->shadow);
+	inInterposer = false;
+
+	int result = real_wait(cond, mutex);
+
+	inInterposer = true;
+	track_acquired(&entry->shadow);
+	inInterposer = false;
+	entry->owner = get_actor();
+	return result;
+}
+
+int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* abstime) {
+
+	preload_resolve();
+	shadow_t* entry = inInterposer ? NULL : preload_getShadow(mutex);
+	if (entry == NULL || entry->owner != get_actor() || entry->depth > 0) {
+		return real_timedwait(cond, mutex, abstime);
+	}
+
+	entry->owner = 0;
+	inInterposer = true;
+	track_released(&entry->shadow);
+	inInterposer = false;
+
+	int result = real_timedwait(cond, mutex, abstime);
+
+	inInterposer = true;
+	track_acquired(&entry->shadow);
+	inInterposer = false;
+	entry->owner = get_actor();
+	return result;
+}
+
+//looks up the real functions; calls may arrive before the constructor runs
+static void preload_resolve() {
+
+	if (real_lock != NULL) {
+		return;
+	}
+
+	real_trylock = dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+	real_unlock = dlsym(RTLD_NEXT, "pthread_mutex_unlock");
+	real_destroy = dlsym(RTLD_NEXT, "pthread_mutex_destroy");
+	real_wait = dlsym(RTLD_NEXT, "pthread_cond_wait");
+	real_timedwait = dlsym(RTLD_NEXT, "pthread_cond_timedwait");
+	__atomic_store_n(&real_lock, dlsym(RTLD_NEXT, "pthread_mutex_lock"), __ATOMIC_RELEASE);
+}
+
+//blocks on a mutex the caller does not hold, checking the RAG before waiting
+static int preload_acquire(shadow_t* entry, pthread_mutex_t* mutex) {
+
+	long long start = preload_now();
+	if (real_trylock(mutex) == 0) {
+		inInterposer = true;
+		track_acquired(&entry->shadow);
+		inInterposer = false;
+		entry->owner = get_actor();
+		entry->acquisitions++;
+		__atomic_add_fetch(&overheadNs, preload_now() - start, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	__atomic_add_fetch(&entry->contentions, 1, __ATOMIC_RELAXED);
+
+	cycle_step_t cycle[SHADOW_REPORT];
+	int length = SHADOW_REPORT;
+
+	inInterposer = true;
+	int safe = track_request(&entry->shadow, cycle, &length);
+	inInterposer = false;
+
+	if (!safe) {
+		__atomic_add_fetch(&entry->cycles, 1, __ATOMIC_RELAXED);
+		preload_reportCycle(entry, cycle, length);
+		if (rejectCycles) {
+			__atomic_add_fetch(&overheadNs, preload_now() - start, __ATOMIC_RELAXED);
+			return EDEADLK;
+		}
+	}
+
+	long long blocked = preload_now();
+	int result = real_lock(mutex);
+	long long woken = preload_now();
+
+	inInterposer = true;
+	if (result == 0) {
+		track_acquired(&entry->shadow);
+	} else if (safe) {
+		track_abandoned(&entry->shadow);
+	}
+	inInterposer = false;
+
+	if (result == 0) {
+		entry->owner = get_actor();
+		entry->acquisitions++;
+		entry->waitNs += woken - blocked;
+	}
+	__atomic_add_fetch(&overheadNs, (blocked - start) + (preload_now() - woken), __ATOMIC_RELAXED);
+
+	return result;
+}
+
+/*
+ * Finds the shadow of 'mutex', creating it on first use; NULL once every slot
+ * is taken. A new mutex takes the first free slot of its probe sequence under
+ * shadowsMutex, so two threads cannot give it two slots, while a mutex that
+ * already has one is found without locking.
+ */
+static shadow_t* preload_getShadow(pthread_mutex_t* mutex) {
+
+	shadow_t* entry = preload_findShadow(mutex, NULL);
+	if (entry != NULL || __atomic_load_n(&shadowsFull, __ATOMIC_ACQUIRE)) {
+		return entry;
+	}
+
+	real_lock(&shadowsMutex);
+	shadow_t* freeSlot;
+	entry = preload_findShadow(mutex, &freeSlot);
+	if (entry == NULL && freeSlot != NULL) {
+		entry = freeSlot;
+		entry->owner = 0;
+		entry->depth = 0;
+		entry->acquisitions = 0;
+		entry->contentions = 0;
+		entry->cycles = 0;
+		entry->waitNs = 0;
+		inInterposer = true;
+		init_lock(&entry->shadow);
+		inInterposer = false;
+		entry->ready = true;
+		__atomic_store_n(&entry->mutex, mutex, __ATOMIC_RELEASE);
+	} else if (entry == NULL) {
+		__atomic_store_n(&shadowsFull, true, __ATOMIC_RELEASE);
+		if (!shadowsWarned) {
+			shadowsWarned = true;
+			inInterposer = true;
+			fprintf(stderr, "smartlock: more than %d mutexes in use; the rest are not tracked\n", SHADOW_SLOTS);
+			inInterposer = false;
+		}
+	}
+	real_unlock(&shadowsMutex);
+
+	return entry;
+}
+
+//looks 'mutex' up along its probe sequence, which ends at a slot never used;
+//'freeSlot', if given, is set to the first slot a new mutex could take
+static shadow_t* preload_findShadow(pthread_mutex_t* mutex, shadow_t** freeSlot) {
+
+	unsigned long hash = ((unsigned long) mutex >> 4) * 0x9E3779B97F4A7C15UL;
+	unsigned long slot = hash >> 52;
+
+	if (freeSlot != NULL) {
+		*freeSlot = NULL;
+	}
+	for (int probe = 0; probe < SHADOW_SLOTS; probe++) {
+		shadow_t* entry = &shadows[(slot + probe) % SHADOW_SLOTS];
+		pthread_mutex_t* current = __atomic_load_n(&entry->mutex, __ATOMIC_ACQUIRE);
+
+		if (current == mutex) {
+			return entry;
+		}
+		if ((current == NULL || current == SHADOW_FREED) && freeSlot != NULL && *freeSlot == NULL) {
+			*freeSlot = entry;
+		}
+		if (current == NULL) {
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+static long long preload_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void preload_reportCycle(shadow_t* entry, cycle_step_t* cycle, int length) {
+
+	inInterposer = true;
+	fprintf(stderr, "smartlock: locking mutex %p would deadlock%s:\n",
+		(void*) entry->mutex, rejectCycles ? "; returning EDEADLK" : "");
+	for (int i = 0; i < length && i < SHADOW_REPORT; i++) {
+		shadow_t* step = (shadow_t*) ((char*) cycle[i].lock - offsetof(shadow_t, shadow));
+		fprintf(stderr, "smartlock:   thread %lu waits for mutex %p\n", cycle[i].tid, (void*) step->mutex);
+	}
+	if (length > SHADOW_REPORT) {
+		fprintf(stderr, "smartlock:   ... and %d more steps\n", length - SHADOW_REPORT);
+	}
+	inInterposer = false;
+}
@@ -0,0 +1,42 @@
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * A host for preload-check, linked with -rdynamic so that its globals are
+ * exported, which defines globals named like the library's own:
+ *		smartlock-preload-host
+ * Two threads contend for a mutex, so the preloaded library builds its RAG;
+ * if the library bound its lists to these arrays it would crash. The exit
+ * status is 0 when the arrays are left as they were.
+ */
+
+long threads[4] = { 1, 2, 3, 4 };
+long resources[4] = { 1, 2, 3, 4 };
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void* contend(void* arg);
+
+int main(void) {
+	pthread_t workers[2];
+	int i;
+	for (i = 0; i < 2; i++) {
+		pthread_create(&workers[i], NULL, contend, NULL);
+	}
+	for (i = 0; i < 2; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	return threads[0] == 1 && resources[0] == 1 ? 0 : 1;
+}
+
+//takes the mutex many times, holding it long enough for the other worker to wait
+void* contend(void* arg) {
+	struct timespec pause = { 0, 1000 };
+	int i;
+	for (i = 0; i < 1000; i++) {
+		pthread_mutex_lock(&mutex);
+		nanosleep(&pause, NULL);
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "klock.h"
+
+/*
+ * Replays files written by start_recording() to compare how lock policies
+ * would have treated the recorded workload:
+ *		smartlock-replay prefix.0 prefix.1 ...
+ * The events of all files are merged by time and each request is judged by
+ * every policy as the recorded holds stood at that moment; the stream itself
+ * goes on as recorded, so a policy's rejections do not change later events.
+ * The estimated wait of a policy is the recorded wait of the requests it
+ * would have let wait, from request to grant.
+ *		recorded: rejections made while recording
+ *		rag:      RAG cycle check, run on shadow SmartLocks
+ *		ordered:  requests for a lock first recorded before a held lock are rejected
+ *		none:     no rejections; requests the RAG rejects are counted as deadlocks
+ */
+
+enum {
+	false,
+	true
+};
+
+enum {
+	POLICY_RECORDED,
+	POLICY_RAG,
+	POLICY_ORDERED,
+	POLICY_NONE,
+	POLICY_COUNT
+};
+
+const char* policyNames[POLICY_COUNT] = { "recorded", "rag", "ordered", "none" };
+
+/*
+ *	defines a recorded lock; it has:
+ *		id:      id of the lock while recording
+ *		shadow:  SmartLock standing for it in the RAG
+ *		holder:  RAG node holding it at this point of the replay, or 0
+ */
+typedef struct {
+	unsigned long long id;
+	SmartLock shadow;
+	unsigned long long holder;
+} replay_lock_t;
+
+/*
+ *	defines a pending request; it has:
+ *		tid:      RAG node making the request
+ *		ns:       time of the request
+ *		rejected: 1 for each policy that rejected it
+ */
+typedef struct {
+	unsigned long long tid;
+	unsigned long long ns;
+	int rejected[POLICY_COUNT];
+} replay_request_t;
+
+/*
+ *	these components define the replay
+ *		events:    every recorded event, sorted by time
+ *		locks:     every recorded lock, sorted by id
+ *		requests:  requests awaiting a grant, rejection or abandonment
+ */
+lock_record_t* events = NULL;
+size_t eventCount = 0;
+replay_lock_t* locks = NULL;
+size_t lockCount = 0;
+replay_request_t* requests = NULL;
+size_t requestCount = 0;
+size_t requestCapacity = 0;
+
+unsigned long long requestTotal = 0;
+unsigned long long rejections[POLICY_COUNT];
+unsigned long long waitNs[POLICY_COUNT];
+unsigned long long deadlocks = 0;
+
+int replay_load(const char* path);
+void replay_indexLocks();
+replay_lock_t* replay_getLock(unsigned long long id);
+replay_request_t* replay_getRequest(unsigned long long tid, int create);
+void replay_removeRequest(replay_request_t* request);
+void replay_event(lock_record_t* event);
+int replay_violatesOrder(unsigned long long tid, unsigned long long id);
+int replay_compareEvents(const void* a, const void* b);
+int replay_compareLocks(const void* a, const void* b);
+
+int main(int argc, char** argv) {
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s file...\n", argv[0]);
+		return 2;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		if (!replay_load(argv[i])) {
+			return 1;
+		}
+	}
+
+	//a release and the grant it allows can share a timestamp; releases sort first
+	qsort(events, eventCount, sizeof(lock_record_t), replay_compareEvents);
+	replay_indexLocks();
+
+	for (size_t i = 0; i < eventCount; i++) {
+		replay_event(&events[i]);
+	}
+
+	printf("%zu events, %zu locks, %llu requests\n", eventCount, lockCount, requestTotal);
+	printf("%-10s %12s %14s\n", "policy", "rejections", "wait_ms");
+	for (int policy = 0; policy < POLICY_COUNT; policy++) {
+		printf("%-10s %12llu %14.3f", policyNames[policy], rejections[policy], waitNs[policy] / 1e6);
+		if (policy == POLICY_NONE) {
+			printf("   (%llu deadlocks)", deadlocks);
+		}
+		printf("\n");
+	}
+
+	cleanup();
+	free(events);
+	free(locks);
+	free(requests);
+	return 0;
+}
+
+//appends the events of one recording file to 'events'
+int replay_load(const char* path) {
+
+	record_reader_t reader;
+	if (!open_recording(&reader, path)) {
+		fprintf(stderr, "%s: not a recording\n", path);
+		return false;
+	}
+	if (reader.dropped > 0) {
+		fprintf(stderr, "%s: %llu events were dropped while recording\n", path, reader.dropped);
+	}
+
+	size_t capacity = eventCount;
+	lock_record_t record;
+	while (read_record(&reader, &record)) {
+		if (eventCount == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 1024;
+			events = realloc(events, capacity * sizeof(lock_record_t));
+		}
+		events[eventCount++] = record;
+	}
+
+	close_recording(&reader);
+	return true;
+}
+
+//creates a shadow SmartLock for each distinct recorded lock
+void replay_indexLocks() {
+
+	locks = malloc((eventCount > 0 ? eventCount : 1) * sizeof(replay_lock_t));
+	for (size_t i = 0; i < eventCount; i++) {
+		locks[i].id = events[i].lock;
+	}
+	qsort(locks, eventCount, sizeof(replay_lock_t), replay_compareLocks);
+
+	for (size_t i = 0; i < eventCount; i++) {
+		if (lockCount == 0 || locks[lockCount - 1].id != locks[i].id) {
+			locks[lockCount++].id = locks[i].id;
+		}
+	}
+
+	//shadows are registered once they stop moving
+	for (size_t i = 0; i < lockCount; i++) {
+		init_lock(&locks[i].shadow);
+		locks[i].holder = 0;
+	}
+}
+
+//applies one recorded event to the RAG and to each policy
+void replay_event(lock_record_t* event) {
+
+	replay_lock_t* lock = replay_getLock(event->lock);
+	replay_request_t* request = replay_getRequest(event->tid, event->event == RECORD_REQUEST);
+	set_actor(event->tid);
+
+	switch (event->event) {
+	case RECORD_REQUEST:
+		//a parked lock_as() request is recorded again when it is retried
+		if (request->ns != 0) {
+			break;
+		}
+		request->ns = event->ns;
+		requestTotal++;
+
+		if (!track_request(&lock->shadow, NULL, NULL)) {
+			request->rejected[POLICY_RAG] = true;
+			rejections[POLICY_RAG]++;
+			deadlocks++;
+		}
+		if (replay_violatesOrder(event->tid, event->lock)) {
+			request->rejected[POLICY_ORDERED] = true;
+			rejections[POLICY_ORDERED]++;
+		}
+		break;
+
+	case RECORD_GRANT:
+		track_acquired(&lock->shadow);
+		lock->holder = event->tid;
+		if (request != NULL) {
+			for (int policy = 0; policy < POLICY_COUNT; policy++) {
+				if (!request->rejected[policy]) {
+					waitNs[policy] += event->ns - request->ns;
+				}
+			}
+			replay_removeRequest(request);
+		}
+		break;
+
+	case RECORD_REJECT:
+	case RECORD_ABANDON:
+		if (event->event == RECORD_REJECT) {
+			rejections[POLICY_RECORDED]++;
+		}
+		track_abandoned(&lock->shadow);
+		if (request != NULL) {
+			replay_removeRequest(request);
+		}
+		break;
+
+	case RECORD_RELEASE:
+		track_released(&lock->shadow);
+		lock->holder = 0;
+		break;
+	}
+
+	set_actor(0);
+}
+
+//returns 1 if 'tid' holds a lock first recorded after the lock 'id'
+int replay_violatesOrder(unsigned long long tid, unsigned long long id) {
+	for (size_t i = 0; i < lockCount; i++) {
+		if (locks[i].holder == tid && locks[i].id > id) {
+			return true;
+		}
+	}
+	return false;
+}
+
+replay_lock_t* replay_getLock(unsigned long long id) {
+	replay_lock_t key;
+	key.id = id;
+	return bsearch(&key, locks, lockCount, sizeof(replay_lock_t), replay_compareLocks);
+}
+
+//finds the pending request of 'tid', adding an empty one if 'create' is set
+replay_request_t* replay_getRequest(unsigned long long tid, int create) {
+
+	for (size_t i = 0; i < requestCount; i++) {
+		if (requests[i].tid == tid) {
+			return &requests[i];
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	if (requestCount == requestCapacity) {
+		requestCapacity = requestCapacity > 0 ? requestCapacity * 2 : 64;
+		requests = realloc(requests, requestCapacity * sizeof(replay_request_t));
+	}
+	replay_request_t* request = &requests[requestCount++];
+	memset(request, 0, sizeof(replay_request_t));
+	request->tid = tid;
+	return request;
+}
+
+void replay_removeRequest(replay_request_t* request) {
+	*request = requests[--requestCount];
+}
+
+int replay_compareEvents(const void* a, const void* b) {
+
+	const lock_record_t* first = a;
+	const lock_record_t* second = b;
+
+	if (first->ns != second->ns) {
+		return first->ns < second->ns ? -1 : 1;
+	}
+	return (first->event != RECORD_RELEASE) - (second->event != RECORD_RELEASE);
+}
+
+int replay_compareLocks(const void* a, const void* b) {
+
+	const replay_lock_t* first = a;
+	const replay_lock_t* second = b;
+
+	if (first->id != second->id) {
+		return first->id < second->id ? -1 : 1;
+	}
+	return 0;
+}